@@ -117,8 +117,8 @@ int main(int argc, char *argv[])
 	pid_t pid = fork();
 	if (pid == 0) {
 		ofs.close();
-		// Become a target for group death
-		// setpgid(0, 0);
+		// Stay in the process group wake created for this job, so
+		// the command and everything it spawns die together with us
 
 		// Prepare the subcommand inputs
 		std::vector<char *> arg, env;
@@ -182,11 +182,18 @@ int main(int argc, char *argv[])
 	if (!JAST::parse(opath.c_str(), ofs, jast))
 		return 1;
 
+	// ru_maxrss is in kilobytes everywhere but macOS
+#ifdef __APPLE__
+	uint64_t membytes = rusage.ru_maxrss;
+#else
+	uint64_t membytes = rusage.ru_maxrss * UINT64_C(1024);
+#endif
+
 	bool first;
 	ofs << "{\"usage\":{\"status\":" << status
 	  << ",\"runtime\":" << (stop.tv_sec - start.tv_sec + (stop.tv_usec - start.tv_usec)/1000000.0)
 	  << ",\"cputime\":" << (rusage.ru_utime.tv_sec + rusage.ru_stime.tv_sec + (rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec)/1000000.0)
-	  << ",\"membytes\":" << rusage.ru_maxrss
+	  << ",\"membytes\":" << membytes
 	  << ",\"inbytes\":" << jast.get("ibytes").value
 	  << ",\"outbytes\":" << jast.get("obytes").value
 	  << "},\"inputs\":[";
@@ -0,0 +1,33 @@
+#ifndef PRELOAD_ACCESS_H
+#define PRELOAD_ACCESS_H
+
+#include <stdint.h>
+#include <string.h>
+
+// preload-wake passes the absolute path of the access log in this variable
+#define ACCESS_LOG_ENV "WAKE_PRELOAD_LOG"
+// The log is a sparse file; only pages actually written consume space
+#define ACCESS_LOG_BYTES (64*1024*1024)
+
+// The access log is a MAP_SHARED file appended to by every process of a job.
+// It holds a sequence of NUL-terminated absolute paths, one per file opened.
+// Entries are reserved with an atomic add, so no locking or syscalls are needed.
+// A process killed mid-append leaves behind NULs, which readers skip.
+struct access_log {
+  uint64_t used;     // bytes reserved in data (may exceed capacity)
+  uint64_t overflow; // non-zero if any access could not be recorded
+};
+
+#define ACCESS_LOG_DATA(log) ((char*)(log) + sizeof(struct access_log))
+#define ACCESS_LOG_CAPACITY (ACCESS_LOG_BYTES - sizeof(struct access_log))
+
+static inline void access_log_append(struct access_log *log, const char *path, uint64_t len) {
+  uint64_t off = __sync_fetch_and_add(&log->used, len+1);
+  if (off + len + 1 > ACCESS_LOG_CAPACITY) {
+    log->overflow = 1;
+  } else {
+    memcpy(ACCESS_LOG_DATA(log) + off, path, len+1);
+  }
+}
+
+#endif
@@ -6,7 +6,9 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
-#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "access.h"
 
 #ifndef O_TMPFILE
 #define O_TMPFILE 0
@@ -25,27 +27,82 @@ struct interpose { const void* my_fn; const void* orig_fn; };
 #define INTERPOSE(fn)
 #endif
 
-static void unlink_guard(const char *filename) {
-  char prefix[] = ".guard-";
+// Number of paths each process remembers having already logged
+#define SEEN_SLOTS 8192
 
-  int last = 0, len;
-  for (len = 0; filename[len]; ++len)
-    if (filename[len] == '/')
-      last = len + 1;
+static struct access_log *access_log;
+// Shared by all threads; slots are accessed atomically, so a race only costs a duplicate entry
+static uint64_t seen[SEEN_SLOTS];
 
-  char buf[len + sizeof(prefix)];
-  memcpy(&buf[0], filename, last);
-  memcpy(&buf[last], prefix, sizeof(prefix)-1);
-  memcpy(&buf[last+sizeof(prefix)-1], filename+last, 1+len-last);
+__attribute__((constructor))
+static void access_init(void) {
+  const char *path = getenv(ACCESS_LOG_ENV);
+  if (!path) return;
 
-  unlink(&buf[0]);
+  // access_log is still null, so our own open() wrapper records nothing here
+  int fd = open(path, O_RDWR);
+  if (fd == -1) return;
+
+  void *map = mmap(0, ACCESS_LOG_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map != MAP_FAILED) access_log = map;
+}
+
+static int get_dir(int dirfd, char *buf, int size) {
+#ifdef __linux__
+  if (dirfd != AT_FDCWD) {
+    char proc[40];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dirfd);
+    ssize_t len = readlink(proc, buf, size);
+    return (len <= 0 || len >= size) ? -1 : len;
+  }
+#endif
+  // Not cached: another thread may chdir at any time
+  if (!getcwd(buf, size)) return -1;
+  return strlen(buf);
+}
+
+// Record that the process accessed a file.
+// Nothing is written to disk; preload-wake reads the shared log after the job exits.
+static void record_access(int dirfd, const char *filename) {
+  if (!access_log || !filename) return;
+
+  char buf[2*PATH_MAX];
+  int len = 0, flen = strlen(filename);
+  if (filename[0] != '/') {
+    len = get_dir(dirfd, buf, PATH_MAX);
+    if (len < 0) {
+      access_log->overflow = 1;
+      return;
+    }
+    buf[len++] = '/';
+  }
+  if (len + flen >= (int)sizeof(buf)) {
+    access_log->overflow = 1;
+    return;
+  }
+  memcpy(buf+len, filename, flen+1);
+  len += flen;
+
+  // FNV-1a; a file opened repeatedly is only logged once per process
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (int i = 0; i < len; ++i) {
+    hash ^= (unsigned char)buf[i];
+    hash *= UINT64_C(1099511628211);
+  }
+  if (hash == 0) hash = 1;
+  uint64_t *slot = &seen[hash % SEEN_SLOTS];
+  if (__atomic_load_n(slot, __ATOMIC_RELAXED) == hash) return;
+  __atomic_store_n(slot, hash, __ATOMIC_RELAXED);
+
+  access_log_append(access_log, buf, len);
 }
 
 #define OPEN(fn)						\
 int PREFIX(fn)(const char *filename, int flags, ...) {		\
   static int (*orig)(const char *, int, ...);			\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(AT_FDCWD, filename);				\
   if ((flags & (O_CREAT|O_TMPFILE))) {				\
     va_list ap;							\
     mode_t mode;						\
@@ -70,7 +127,7 @@ OPEN(__open64)
 int PREFIX(fn)(const char *filename, int flags) {		\
   static int (*orig)(const char *, int);			\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(AT_FDCWD, filename);				\
   return orig(filename, flags);					\
 }								\
 INTERPOSE(fn)
@@ -84,7 +141,7 @@ OPEN2(__open64_2)
 int PREFIX(fn)(int dirfd, const char *filename, int flags, ...) {\
   static int (*orig)(int dirfd, const char *, int, ...);	\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(dirfd, filename);				\
   if ((flags & (O_CREAT|O_TMPFILE))) {				\
     va_list ap;							\
     mode_t mode;						\
@@ -107,7 +164,7 @@ OPENAT(openat64)
 int PREFIX(fn)(int dirfd, const char *filename, int flags) {	\
   static int (*orig)(int dirfd, const char *, int);		\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(dirfd, filename);				\
   return orig(dirfd, filename, flags);				\
 }								\
 INTERPOSE(fn)
@@ -121,7 +178,7 @@ OPENAT2(__openat64_2)
 int PREFIX(fn)(const char *filename, mode_t mode) {		\
   static int (*orig)(const char *, mode_t);			\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(AT_FDCWD, filename);				\
   return orig(filename, mode);					\
 }								\
 INTERPOSE(fn)
@@ -135,7 +192,7 @@ CREAT(creat64)
 FILE *PREFIX(fn)(const char *filename, const char *mode) {	\
   static FILE *(*orig)(const char *, const char *);		\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(AT_FDCWD, filename);				\
   return orig(filename, mode);					\
 }								\
 INTERPOSE(fn)
@@ -149,7 +206,7 @@ FOPEN(fopen64)
 FILE *PREFIX(fn)(const char *filename, const char *mode, FILE *s) {\
   static FILE *(*orig)(const char *, const char *, FILE *);	\
   FORWARD(fn);							\
-  unlink_guard(filename);					\
+  record_access(AT_FDCWD, filename);				\
   return orig(filename, mode, s);				\
 }								\
 INTERPOSE(fn)
@@ -162,7 +219,7 @@ FREOPEN(freopen64)
 int PREFIX(execv)(const char *path, char *const argv[]) {
   static int (*orig)(const char *, char *const []);
   FORWARD(execv);
-  unlink_guard(path);
+  record_access(AT_FDCWD, path);
   return orig(path, argv);
 }
 INTERPOSE(execv)
@@ -220,7 +277,7 @@ INTERPOSE(execvp)
 int PREFIX(execve)(const char *filename, char *const argv[], char *const envp[]) {
   static int (*orig)(const char *, char *const [], char *const []);
   FORWARD(execve);
-  unlink_guard(filename);
+  record_access(AT_FDCWD, filename);
   return orig(filename, argv, envp);
 }
 INTERPOSE(execve)
@@ -301,31 +358,3 @@ int PREFIX(execle)(const char *path, const char *arg, ... /*, (char *) NULL, cha
   return PREFIX(execve)(path, argv, envp);
 }
 INTERPOSE(execle)
-
-struct dirent *PREFIX(readdir)(DIR *dirp) {
-  static struct dirent *(*orig)(DIR *);
-  FORWARD(readdir);
-  struct dirent *out;
-  do out = orig(dirp);
-  while (out &&
-    out->d_name[0] == '.' && out->d_name[1] == 'g' &&
-    out->d_name[2] == 'u' && out->d_name[3] == 'a' &&
-    out->d_name[4] == 'r' && out->d_name[5] == 'd' &&
-    out->d_name[6] == '-');
-  return out;
-}
-INTERPOSE(readdir)
-
-int PREFIX(readdir_r)(DIR *dirp, struct dirent *entry, struct dirent **result) {
-  static int (*orig)(DIR *, struct dirent *, struct dirent **);
-  FORWARD(readdir_r);
-  int out;
-  do out = orig(dirp, entry, result);
-  while (*result &&
-    entry->d_name[0] == '.' && entry->d_name[1] == 'g' &&
-    entry->d_name[2] == 'u' && entry->d_name[3] == 'a' &&
-    entry->d_name[4] == 'r' && entry->d_name[5] == 'd' &&
-    entry->d_name[6] == '-');
-  return out;
-}
-INTERPOSE(readdir_r)
@@ -8,13 +8,17 @@
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <signal.h>
+#include <limits.h>
 #include "json5.h"
 #include "execpath.h"
+#include "access.h"
 
 #define STR2(x) #x
 #define STR(x) STR2(x)
@@ -22,13 +26,7 @@
 typedef std::set<std::string> sset;
 typedef std::vector<std::string> svec;
 
-static std::string makeGuard(const std::string &file) {
-  size_t slash = file.find_last_of('/');
-  if (slash == std::string::npos) slash = 0; else ++slash;
-  return file.substr(0, slash) + ".guard-" + file.substr(slash);
-}
-
-static void make_shadow_tree(const std::string &root, const JAST &jast, sset &visible, sset &guards) {
+static void make_shadow_tree(const std::string &root, const JAST &jast, sset &visible) {
   std::string roots = root + "/";
 
   for (auto &x : jast.get("visible").children) {
@@ -70,15 +68,6 @@ static void make_shadow_tree(const std::string &root, const JAST &jast, sset &vi
           std::cerr << "link " << target << ": " << strerror(errno) << std::endl;
           exit(1);
         }
-        std::string guard = makeGuard(file);
-        std::string target_guard = roots + guard;
-        int fd = open(target_guard.c_str(), O_CREAT|O_EXCL, 0664);
-        if (fd == -1) {
-          std::cerr << "open " << target_guard << ": " << strerror(errno) << std::endl;
-          exit(1);
-        }
-        close(fd);
-        guards.insert(guard);
       }
     }
   }
@@ -146,26 +135,75 @@ static void scan_shadow_tree(sset &exist, const std::string &path) {
   scan_shadow_tree(exist, "", dirfd);
 }
 
+static struct access_log *create_access_log(const std::string &file) {
+  int fd = open(file.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0664);
+  if (fd == -1) {
+    std::cerr << "open " << file << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  if (ftruncate(fd, ACCESS_LOG_BYTES) != 0) {
+    std::cerr << "ftruncate " << file << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  void *map = mmap(0, ACCESS_LOG_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    std::cerr << "mmap " << file << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+  close(fd);
+  return static_cast<struct access_log*>(map);
+}
+
+// wake sends SIGTERM before SIGKILL; remove the log instead of leaking it in .build
+static char access_log_path[PATH_MAX];
+static void drop_access_log(int sig) {
+  unlink(access_log_path);
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+// Remove '.', '..', and repeated '/' from an absolute path
+static std::string simplify_path(const char *path) {
+  svec tokens;
+  for (const char *tok = path; *tok; ) {
+    const char *end = tok;
+    while (*end && *end != '/') ++end;
+    std::string token(tok, end-tok);
+    if (token == "..") {
+      if (!tokens.empty()) tokens.pop_back();
+    } else if (!token.empty() && token != ".") {
+      tokens.emplace_back(std::move(token));
+    }
+    tok = *end ? end+1 : end;
+  }
+  std::string out;
+  for (auto &x : tokens) out += "/" + x;
+  return out;
+}
+
+// Translate the absolute paths logged by the job into files relative to the shadow tree
+static void read_access_log(const struct access_log *log, const std::string &root, sset &accessed) {
+  std::string prefix = simplify_path(root.c_str()) + "/";
+  const char *data = ACCESS_LOG_DATA(log);
+  const char *end = data + std::min<uint64_t>(log->used, ACCESS_LOG_CAPACITY);
+  for (const char *tok = data; tok < end; tok += strlen(tok) + 1) {
+    if (!*tok) continue;
+    std::string path = simplify_path(tok);
+    if (path.compare(0, prefix.size(), prefix) == 0)
+      accessed.insert(path.substr(prefix.size()));
+  }
+}
+
 #ifdef __APPLE__
 #define st_mtim st_mtimespec
 #endif
 
-static void compute_inout(const sset &exist, const sset &guards, const sset &visible, const struct timeval &start, svec &inputs, svec &outputs) {
-  // First, compute exist - guards
-  svec emg;
-  auto e = exist.begin(), g = guards.begin();
-  while (e != exist.end() && g != guards.end()) {
-    int comp = e->compare(*g);
-    if      (comp < 0) emg.emplace_back(*e++);
-    else if (comp > 0) ++g;
-    else { ++e; ++g; }
-  }
-  while (e != exist.end()) emg.emplace_back(*e++);
-
-  // Next, consider the set relationships between emg and visible
-  auto m = emg.begin();
+static void compute_inout(const sset &exist, const sset &accessed, bool all, const sset &visible, const struct timeval &start, svec &inputs, svec &outputs) {
+  // Consider the set relationships between exist and visible
+  svec found(exist.begin(), exist.end());
+  auto m = found.begin();
   auto v = visible.begin();
-  while (m != emg.end() && v != visible.end()) {
+  while (m != found.end() && v != visible.end()) {
     int comp = m->compare(*v);
     if (comp < 0) {
       outputs.emplace_back(std::move(*m));
@@ -183,7 +221,7 @@ static void compute_inout(const sset &exist, const sset &guards, const sset &vis
           (sbuf.st_mtim.tv_sec == start.tv_sec &&
            sbuf.st_mtim.tv_nsec > start.tv_usec*1000)) {
         outputs.emplace_back(std::move(*m));
-      } else if (exist.find(makeGuard(*m)) == exist.end()) {
+      } else if (all || accessed.find(*m) != accessed.end()) {
         inputs.emplace_back(std::move(*m));
       }
       ++m;
@@ -193,7 +231,7 @@ static void compute_inout(const sset &exist, const sset &guards, const sset &vis
       ++v;
     }
   }
-  for (; m != emg.end(); ++m) outputs.emplace_back(std::move(*m));
+  for (; m != found.end(); ++m) outputs.emplace_back(std::move(*m));
   if (v != visible.end()) {
     std::cerr << "Visible file was deleted: " << *v << std::endl;
     exit(1);
@@ -274,13 +312,25 @@ int main(int argc, const char **argv) {
     exit(1);
   }
 
-  sset visible, guards;
-  make_shadow_tree(root, jast, visible, guards);
+  sset visible;
+  make_shadow_tree(root, jast, visible);
+
+  std::string abs_root = get_cwd() + "/" + root;
+  std::string logfile = abs_root + ".log";
+  struct access_log *log = create_access_log(logfile);
+  if (logfile.size() < sizeof(access_log_path)) {
+    strcpy(access_log_path, logfile.c_str());
+    signal(SIGTERM, drop_access_log);
+    signal(SIGINT,  drop_access_log);
+    signal(SIGHUP,  drop_access_log);
+  }
 
   // Prepare the subcommand inputs
   std::vector<char *> arg, env;
   std::string preload = STR(ENV) "=" + find_execpath() + "/libpreload-wake." STR(EXT);
+  std::string logenv = ACCESS_LOG_ENV "=" + logfile;
   env.push_back(const_cast<char*>(preload.c_str()));
+  env.push_back(const_cast<char*>(logenv.c_str()));
 
   for (auto &x : jast.get("command").children)
     arg.push_back(const_cast<char*>(x.second.value.c_str()));
@@ -298,6 +348,9 @@ int main(int argc, const char **argv) {
 
   pid_t pid = fork();
   if (pid == 0) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGHUP,  SIG_DFL);
     if (chdir(dir.c_str()) != 0) {
       std::cerr << "chdir " << dir << ": " << strerror(errno) << std::endl;
       exit(1);
@@ -313,7 +366,8 @@ int main(int argc, const char **argv) {
     }
 
     std::string command = find_in_path(arg[0], find_path(env.data()));
-    unlink(makeGuard(command).c_str());
+    std::string abs_command = command[0] == '/' ? command : get_cwd() + "/" + command;
+    access_log_append(log, abs_command.c_str(), abs_command.size());
     execve(command.c_str(), arg.data(), env.data());
     std::cerr << "execve " << command << ": " << strerror(errno) << std::endl;
     exit(1);
@@ -333,25 +387,38 @@ int main(int argc, const char **argv) {
   struct timeval stop;
   gettimeofday(&stop, 0);
 
-  sset exist;
+  sset exist, accessed;
   svec inputs, outputs;
 
+  // If the log overflowed, conservatively treat every visible file as an input
+  read_access_log(log, abs_root, accessed);
+  bool all = log->overflow != 0;
+  munmap(log, ACCESS_LOG_BYTES);
+  unlink(logfile.c_str());
+
   scan_shadow_tree(exist, root);
-  compute_inout(exist, guards, visible, start, inputs, outputs);
+  compute_inout(exist, accessed, all, visible, start, inputs, outputs);
   relink_shadow_tree(root, outputs);
   remove_shadow_tree(root, exist);
-  
+
   std::ofstream out(argv[2], std::ios_base::trunc);
   if (out.fail()) {
     std::cerr << "ofstream " << argv[2] << ": " << strerror(errno) << std::endl;
     exit(1);
   }
 
+  // ru_maxrss is in kilobytes everywhere but macOS
+#ifdef __APPLE__
+  uint64_t membytes = rusage.ru_maxrss;
+#else
+  uint64_t membytes = rusage.ru_maxrss * UINT64_C(1024);
+#endif
+
   bool first;
   out << "{\"usage\":{\"status\":" << status
     << ",\"runtime\":" << (stop.tv_sec - start.tv_sec + (stop.tv_usec - start.tv_usec)/1000000.0)
     << ",\"cputime\":" << (rusage.ru_utime.tv_sec + rusage.ru_stime.tv_sec + (rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec)/1000000.0)
-    << ",\"membytes\":" << rusage.ru_maxrss
+    << ",\"membytes\":" << membytes
     << ",\"inbytes\":" << rusage.ru_inblock * UINT64_C(512)
     << ",\"outbytes\":" << rusage.ru_oublock * UINT64_C(512)
     << "},\"inputs\":[";
@@ -25,10 +25,36 @@ tooltip.style.visibility = 'hidden';
 const usecss = document.createElement('div');
 usecss.appendChild(document.createElement('style'));
 
+// uses of a definition in other pages
+const uses = document.createElement('div');
+uses.classList.add('uses');
+uses.style.visibility = 'hidden';
+
 let depth = 0;
 let inner = null;
 let select = null;
 
+// page number of this file when rendered with --html=DIR, else null
+let page = null;
+let xref = null;
+let xrefWaiting = [];
+
+// xref.js is a script (not JSON) so that it also loads from file:// URLs
+window.wakeXref = function (data) {
+  xref = data;
+  for (let f of xrefWaiting) f(xref);
+  xrefWaiting = [];
+};
+
+function withXref(f) {
+  if (page === null) return;
+  if (xref) { f(xref); return; }
+  if (xrefWaiting.push(f) > 1) return;
+  let script = document.createElement('script');
+  script.src = 'xref.js';
+  document.head.appendChild(script);
+}
+
 function update () {
   let next = inner;
   for (let i = 0; i < depth; ++i) {
@@ -54,6 +80,7 @@ function update () {
 }
 
 document.onMouseOver = function (that, event) {
+  withXref(function () { });
   inner = that;
   depth = 0;
   update();
@@ -89,23 +116,61 @@ function smoothFromTo(fromX, fromY, destX, destY, step) {
     setTimeout(function () { smoothFromTo(fromX, fromY, destX, destY, step+1); }, stepMs);
 }
 
-document.focusOn = function (that, event) {
-  const target = that.getAttribute('href').substring(1);
-  const where = document.getElementById(target).getBoundingClientRect();
+function scrollToElement(element) {
+  const where = element.getBoundingClientRect();
   const fromX = window.scrollX;
   const fromY = window.scrollY;
   const destX = (where.left + where.right  - window.innerWidth)  / 2 + fromX;
   const destY = (where.top  + where.bottom - window.innerHeight) / 2 + fromY;
+  smoothFromTo(fromX, fromY, destX, destY, 1);
+}
 
-  usecss.firstChild.innerHTML = '*[id=\'' + target + '\'] { background-color: red; }';
-  window.location.hash = target;
+document.focusOn = function (that, event) {
+  const target = that.getAttribute('href').substring(1);
+  const element = document.getElementById(target);
   event.preventDefault();
 
-  smoothFromTo(fromX, fromY, destX, destY, 1);
+  if (!element) {
+    const file = that.getAttribute('targetFile');
+    withXref(function (xref) {
+      const i = xref.files.indexOf(file);
+      if (i !== -1) window.location.href = i + '.html#' + target;
+    });
+    return;
+  }
+
+  usecss.firstChild.innerHTML = '*[id=\'' + target + '\'] { background-color: red; }';
+  window.location.hash = target;
+  scrollToElement(element);
 };
 
+function showUses(that, xref) {
+  const key = page + ':' + that.id.split(':').slice(-2).join(':');
+  const byPage = new Map();
+  for (let use of xref.uses[key] || [])
+    if (use[0] !== page) {
+      if (!byPage.has(use[0])) byPage.set(use[0], []);
+      byPage.get(use[0]).push(use[3]);
+    }
+
+  uses.innerHTML = '';
+  if (byPage.size === 0) {
+    uses.style.visibility = 'hidden';
+    return;
+  }
+  for (let [i, rows] of byPage) {
+    let a = document.createElement('a');
+    a.setAttribute('href', i + '.html#' + that.id);
+    a.textContent = xref.files[i] + ':' + rows.join(',');
+    uses.appendChild(a);
+    uses.appendChild(document.createElement('br'));
+  }
+  uses.style.visibility = 'visible';
+}
+
 document.onMouseClick = function (that, event) {
   usecss.firstChild.innerHTML = '*[href=\'#' + that.id + '\'] { background-color: red; }';
+  withXref(function (xref) { showUses(that, xref); });
   event.stopPropagation();
 };
 
@@ -132,6 +197,7 @@ function render(root) {
 
     if (node.target) {
       res.setAttribute('href', '#' + node.target.filename + ':' + node.target.range.join(':'));
+      res.setAttribute('targetFile', node.target.filename);
       res.setAttribute('onclick', 'focusOn(this, event)');
     }
 
@@ -179,13 +245,29 @@ function workspace(node) {
 document.addEventListener('DOMContentLoaded', function main () {
   document.body.appendChild(usecss);
   document.body.appendChild(tooltip);
+  document.body.appendChild(uses);
   var points = document.querySelectorAll('*');
   for (let point of points) {
     if (point.type === 'wake') {
       const node = JSON.parse(point.innerHTML);
+      if (node.page !== undefined) page = node.page;
       document.body.appendChild(workspace(node));
     }
   }
+
+  // Arriving from another page: show the definition, or else its uses here
+  const target = decodeURIComponent(window.location.hash.substring(1));
+  if (target) {
+    const element = document.getElementById(target);
+    if (element) {
+      usecss.firstChild.innerHTML = '*[id=\'' + target + '\'] { background-color: red; }';
+      scrollToElement(element);
+    } else {
+      usecss.firstChild.innerHTML = '*[href=\'#' + target + '\'] { background-color: red; }';
+      const use = document.querySelector('*[href=\'#' + target + '\']');
+      if (use) scrollToElement(use);
+    }
+  }
 });
 
 /* eslint-env browser */
@@ -27,6 +27,7 @@
 #include <list>
 #include <cassert>
 #include <algorithm>
+#include <time.h>
 
 typedef std::map<std::string, int> NameIndex;
 
@@ -868,9 +869,60 @@ static bool explore(Expr *expr, const PrimMap &pmap, NameBinding *binding) {
   }
 }
 
-std::unique_ptr<Expr> bind_refs(std::unique_ptr<Top> top, const PrimMap &pmap) {
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+typedef std::vector<const DefBinding::Order::value_type*> OrderIndex;
+
+static void add_timing(std::vector<TypeTiming> *timing, const OrderIndex &names, size_t index, double start) {
+  if (!timing || index >= names.size() || !names[index]) return;
+  timing->emplace_back(names[index]->first, names[index]->second.location, now() - start);
+}
+
+// The top-level DefBindings, one per level of value dependencies, are explored one SCC at a time
+static bool explore_top(Expr *expr, const PrimMap &pmap, NameBinding *binding, std::vector<TypeTiming> *timing) {
+  if (!expr || expr->type != &DefBinding::type) return explore(expr, pmap, binding);
+  DefBinding *def = static_cast<DefBinding*>(expr);
+  def->typeVar.setDOB();
+  binding->open = false;
+  NameBinding bind(binding, def);
+  OrderIndex names;
+  if (timing) {
+    names.resize(def->val.size() + def->fun.size());
+    for (auto &o : def->order)
+      if (o.second.index < (int)names.size()) names[o.second.index] = &o;
+  }
+  bool ok = true;
+  for (size_t i = 0; i < def->val.size(); ++i) {
+    double start = timing ? now() : 0;
+    ok = explore(def->val[i].get(), pmap, binding) && ok;
+    add_timing(timing, names, i, start);
+  }
+  for (int i = 0, j; i < (int)def->fun.size(); i = j) {
+    double start = timing ? now() : 0;
+    def->fun[i]->typeVar.setDOB();
+    for (j = i+1; j < (int)def->fun.size() && i == def->scc[j]; ++j)
+      if (def->fun[j]) def->fun[j]->typeVar.setDOB(def->fun[i]->typeVar);
+    bind.generalized = def->val.size() + def->scc[i];
+    for (int k = i; k < j; ++k)
+      ok = explore(def->fun[k].get(), pmap, &bind) && ok;
+    add_timing(timing, names, def->val.size() + i, start);
+  }
+  bind.generalized = def->val.size() + def->fun.size();
+  ok = explore_top(def->body.get(), pmap, &bind, timing) && ok;
+  ok = ok && def->typeVar.unify(def->body->typeVar, &def->location) && ok;
+  return ok;
+}
+
+std::unique_ptr<Expr> bind_refs(std::unique_ptr<Top> top, const PrimMap &pmap, std::vector<TypeTiming> *timing) {
   NameBinding bottom;
   std::unique_ptr<Expr> out = fracture(std::move(top), 0);
-  if (out && !explore(out.get(), pmap, &bottom)) out.reset();
+  bool ok = timing
+    ? explore_top(out.get(), pmap, &bottom, timing)
+    : explore(out.get(), pmap, &bottom);
+  if (out && !ok) out.reset();
   return out;
 }
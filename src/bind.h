@@ -19,12 +19,24 @@
 #define BIND_H
 
 #include <memory>
+#include <string>
+#include <vector>
+#include "location.h"
 #include "prim.h"
 
 struct Top;
 struct Expr;
 
+// Time spent typing one top-level value or function SCC
+struct TypeTiming {
+  std::string name; // of its first definition
+  Location location;
+  double seconds;
+  TypeTiming(const std::string &name_, const Location &location_, double seconds_)
+   : name(name_), location(location_), seconds(seconds_) { }
+};
+
 // Eliminate DefMap + Top + Subscribe expressions
-std::unique_ptr<Expr> bind_refs(std::unique_ptr<Top> top, const PrimMap &pmap);
+std::unique_ptr<Expr> bind_refs(std::unique_ptr<Top> top, const PrimMap &pmap, std::vector<TypeTiming> *timing = 0);
 
 #endif
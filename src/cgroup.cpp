@@ -0,0 +1,185 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "cgroup.h"
+#include "database.h"
+#include "status.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+
+// Jobs may use this multiple of their predicted memory before being killed ...
+#define MEMORY_SLACK 2
+// ... but are always allowed at least this much
+#define MEMORY_FLOOR (UINT64_C(256) << 20)
+
+static std::string base;  // the cgroup wake manages; empty if disabled
+static std::string self;  // leaf holding wake itself (a parent may not hold processes)
+static std::string tag;   // distinguishes our job leaves from those of other wake processes
+static bool enforce;
+
+static bool write_file(const std::string &file, const std::string &data) {
+  int fd = open(file.c_str(), O_WRONLY|O_CLOEXEC);
+  if (fd == -1) return false;
+  bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+  return close(fd) == 0 && ok;
+}
+
+static bool read_file(const std::string &file, std::string &out) {
+  std::ifstream ifs(file);
+  if (ifs.fail()) return false;
+  out.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+  return !ifs.bad();
+}
+
+// Sum every 'key value' or 'key=value' field named key (io.stat has one line per device)
+static bool read_field(const std::string &text, const char *key, uint64_t &out) {
+  size_t len = strlen(key);
+  bool found = false;
+  out = 0;
+  for (size_t i = text.find(key); i != std::string::npos; i = text.find(key, i+len)) {
+    bool start = i == 0 || text[i-1] == ' ' || text[i-1] == '\n';
+    bool sep = i+len < text.size() && (text[i+len] == ' ' || text[i+len] == '=');
+    if (start && sep) {
+      out += strtoull(text.c_str()+i+len+1, 0, 10);
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool cgroup_enabled() {
+  return !base.empty();
+}
+
+std::string cgroup_init(bool enforce_) {
+  std::ifstream proc("/proc/self/cgroup");
+  std::string line, path;
+  while (std::getline(proc, line))
+    if (line.compare(0, 3, "0::") == 0)
+      path = line.substr(3);
+  if (path.empty()) return "cgroup v2 is not in use";
+
+  // Usually /sys/fs/cgroup, but /sys/fs/cgroup/unified on hybrid systems
+  std::ifstream mounts("/proc/self/mounts");
+  std::string dev, mount, type, root;
+  while (root.empty() && mounts >> dev >> mount >> type) {
+    if (type == "cgroup2") root = mount;
+    std::getline(mounts, line);
+  }
+  if (root.empty()) return "cgroup v2 is not mounted";
+
+  std::string dir = root + path;
+  while (dir.back() == '/') dir.resize(dir.size()-1);
+
+  // Remove leaves left behind by earlier wake processes (rmdir fails if still in use)
+  if (DIR *d = opendir(dir.c_str())) {
+    while (struct dirent *e = readdir(d))
+      if (!strncmp(e->d_name, "wake.", 5) || !strncmp(e->d_name, "job.", 4))
+        (void)rmdir((dir + "/" + e->d_name).c_str());
+    closedir(d);
+  }
+
+  tag = std::to_string(getpid());
+  std::string leaf = dir + "/wake." + tag;
+  if (mkdir(leaf.c_str(), 0755) != 0)
+    return "mkdir " + leaf + ": " + strerror(errno) + " (is the cgroup delegated?)";
+
+  if (!write_file(leaf + "/cgroup.procs", "0")) {
+    std::string out = "join " + leaf + ": " + strerror(errno);
+    (void)rmdir(leaf.c_str());
+    return out;
+  }
+
+  // cpu and io accounting are best-effort; memory is the reason we are here
+  if (!write_file(dir + "/cgroup.subtree_control", "+memory")) {
+    std::string out = "enable memory controller in " + dir + ": " + strerror(errno);
+    if (errno == EBUSY) out += " (does it hold other processes?)";
+    (void)write_file(dir + "/cgroup.procs", "0");
+    (void)rmdir(leaf.c_str());
+    return out;
+  }
+  (void)write_file(dir + "/cgroup.subtree_control", "+cpu");
+  (void)write_file(dir + "/cgroup.subtree_control", "+io");
+
+  base = dir;
+  self = leaf;
+  enforce = enforce_;
+  return "";
+}
+
+static std::string job_leaf(long job) {
+  return base + "/job." + tag + "." + std::to_string(job);
+}
+
+std::string cgroup_create(long job, uint64_t membytes) {
+  std::string leaf = job_leaf(job);
+  if (mkdir(leaf.c_str(), 0755) != 0 && errno != EEXIST) return "";
+
+  if (enforce && membytes) {
+    uint64_t limit = MEMORY_SLACK * membytes;
+    if (limit < MEMORY_FLOOR) limit = MEMORY_FLOOR;
+    (void)write_file(leaf + "/memory.max", std::to_string(limit));
+  }
+
+  return leaf + "/cgroup.procs";
+}
+
+bool cgroup_collect(long job, Usage &usage) {
+  std::string leaf = job_leaf(job);
+  std::string text;
+  uint64_t value;
+
+  // A leaf which never held the job has no usage
+  bool joined = read_file(leaf + "/cpu.stat", text) && read_field(text, "usage_usec", value) && value;
+  if (joined) {
+    usage.cputime = value / 1000000.0;
+    // memory.peak needs linux 5.19; otherwise keep the rusage figure
+    if (read_file(leaf + "/memory.peak", text)) usage.membytes = strtoull(text.c_str(), 0, 10);
+    if (read_file(leaf + "/io.stat", text)) {
+      if (read_field(text, "rbytes", value)) usage.ibytes = value;
+      if (read_field(text, "wbytes", value)) usage.obytes = value;
+    }
+    if (read_file(leaf + "/memory.events", text) && read_field(text, "oom_kill", value) && value) {
+      std::string max;
+      (void)read_file(leaf + "/memory.max", max);
+      while (!max.empty() && max.back() == '\n') max.resize(max.size()-1);
+      std::stringstream s;
+      s << "Job " << job << " was killed for exceeding its memory limit of " << max << " bytes" << std::endl;
+      std::string out = s.str();
+      status_write(2, out.data(), out.size());
+    }
+  }
+
+  // Daemons spawned by the job (eg: fuse-waked) outlive it; move them next to wake
+  if (read_file(leaf + "/cgroup.procs", text)) {
+    std::stringstream pids(text);
+    std::string pid;
+    while (pids >> pid) (void)write_file(self + "/cgroup.procs", pid);
+  }
+  (void)rmdir(leaf.c_str());
+
+  return joined;
+}
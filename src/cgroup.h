@@ -0,0 +1,35 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <string>
+#include <stdint.h>
+
+struct Usage;
+
+// Take over the (delegated) cgroup v2 wake runs in; returns why not on failure
+std::string cgroup_init(bool enforce);
+bool cgroup_enabled();
+
+// Create a leaf for the job; the child must write "0" to the returned cgroup.procs
+std::string cgroup_create(long job, uint64_t membytes);
+// Overwrite usage with the leaf's accounting and remove it; false if the job never joined
+bool cgroup_collect(long job, Usage &usage);
+
+#endif
@@ -17,19 +17,89 @@
 
 #include "database.h"
 #include "status.h"
+#include "hash.h"
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <algorithm>
 #include <sqlite3.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #define VISIBLE 0
 #define INPUT 1
 #define OUTPUT 2
 #define INDEXES 3
 
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+
+// Bump whenever the schema changes incompatibly, and teach migrate() the step
+#define SCHEMA_VERSION 3
+
+// Paths inserted into filetree per statement step
+#define TREE_BATCH 64
+// Cached jobs with more outputs than this are validated by the CheckPool
+#define CHECK_BATCH 64
+// Threads validating a cached job, counting the caller
+#define CHECK_THREADS 8
+// Pages returned per incremental vacuum step of --db-maintain
+#define VACUUM_SLICE "4096"
+
+struct StatementProfile {
+  long calls, rows;
+  double total, max, current; // seconds; max and current are per execution
+  StatementProfile() : calls(0), rows(0), total(0), max(0), current(0) { }
+};
+
+// Threads which check that the outputs of a cached job are readable.
+// They start with the first large check and live as long as the Database.
+struct CheckPool {
+  std::mutex mutex;
+  std::condition_variable wake, done;
+  std::vector<std::thread> threads;
+  const std::vector<FileReflection> *files; // being checked; null when idle
+  std::atomic<size_t> next;
+  std::atomic<bool> missing;
+  size_t busy;         // threads still checking files
+  unsigned long round; // counts checks, so each thread joins every one once
+  bool stop;
+
+  CheckPool() : files(0), next(0), missing(false), busy(0), round(0), stop(false) { }
+  ~CheckPool();
+
+  bool all_readable(const std::vector<FileReflection> &list);
+  void scan(const std::vector<FileReflection> &list);
+  void work();
+};
+
 struct Database::detail {
   bool debugdb;
+  bool profiledb;
+  std::unordered_map<sqlite3_stmt*, std::string> names; // statement -> detail member
+  std::map<std::string, StatementProfile> profile;
   sqlite3 *db;
+  int lockfd; // flock held by the (single) writer
   sqlite3_stmt *get_entropy;
   sqlite3_stmt *set_entropy;
   sqlite3_stmt *add_target;
@@ -40,6 +110,7 @@ struct Database::detail {
   sqlite3_stmt *stats_job;
   sqlite3_stmt *insert_job;
   sqlite3_stmt *insert_tree;
+  sqlite3_stmt *insert_trees;
   sqlite3_stmt *insert_log;
   sqlite3_stmt *wipe_file;
   sqlite3_stmt *insert_file;
@@ -48,7 +119,6 @@ struct Database::detail {
   sqlite3_stmt *get_tree;
   sqlite3_stmt *add_stats;
   sqlite3_stmt *link_stats;
-  sqlite3_stmt *detect_overlap;
   sqlite3_stmt *delete_overlap;
   sqlite3_stmt *find_prior;
   sqlite3_stmt *update_prior;
@@ -60,24 +130,190 @@ struct Database::detail {
   sqlite3_stmt *delete_stats;
   sqlite3_stmt *revtop_order;
   sqlite3_stmt *setcrit_path;
+  sqlite3_stmt *last_crit;
+  sqlite3_stmt *last_inputs;
+  sqlite3_stmt *add_profile;
+  sqlite3_stmt *add_limit;
+  sqlite3_stmt *index_log;
+  sqlite3_stmt *get_log_size;
+  sqlite3_stmt *find_job;
+  sqlite3_stmt *find_file;
+  sqlite3_stmt *file_readers;
+  sqlite3_stmt *job_outputs;
+  sqlite3_stmt *job_summary;
+  sqlite3_stmt *find_dir;
+  sqlite3_stmt *add_dir;
+  sqlite3_stmt *get_dir;
+  sqlite3_stmt *get_file;
+  sqlite3_stmt *find_visible;
+  sqlite3_stmt *add_visible;
+  sqlite3_stmt *link_visible;
+  sqlite3_stmt *get_visible;
+  sqlite3_stmt *delete_visible;
+  sqlite3_stmt *find_blob;
+  sqlite3_stmt *add_blob;
+  sqlite3_stmt *delete_blobs;
 
   long run_id;
-  detail(bool debugdb_)
-   : debugdb(debugdb_), db(0), get_entropy(0), set_entropy(0), add_target(0), del_target(0), begin_txn(0),
-     commit_txn(0), predict_job(0), stats_job(0), insert_job(0), insert_tree(0), insert_log(0),
+  long version; // user_version of wake.db when opened; migrated once the hash key is known
+  int txn_depth;
+  // files and dirs rows are never deleted, so these caches stay valid
+  std::unordered_map<std::string, long> file_ids;
+  std::unordered_map<std::string, long> dir_ids;  // "a/b/" -> dir_id
+  std::unordered_map<long, std::string> dir_paths; // dir_id -> "a/b/"
+  // Output file_id -> the job of this run which produced (or reused) it
+  std::unordered_map<long, long> owners;
+  CheckPool checker;
+  detail(bool debugdb_, bool profiledb_)
+   : debugdb(debugdb_), profiledb(profiledb_), db(0), lockfd(-1), get_entropy(0), set_entropy(0), add_target(0), del_target(0), begin_txn(0),
+     commit_txn(0), predict_job(0), stats_job(0), insert_job(0), insert_tree(0), insert_trees(0), insert_log(0),
      wipe_file(0), insert_file(0), update_file(0), get_log(0), get_tree(0), add_stats(0), link_stats(0),
-     detect_overlap(0), delete_overlap(0), find_prior(0), update_prior(0), delete_prior(0), find_owner(0),
-     fetch_hash(0), delete_jobs(0), delete_dups(0), delete_stats(0), revtop_order(0), setcrit_path(0) { }
+     delete_overlap(0), find_prior(0), update_prior(0), delete_prior(0), find_owner(0),
+     fetch_hash(0), delete_jobs(0), delete_dups(0), delete_stats(0), revtop_order(0), setcrit_path(0),
+     last_crit(0), last_inputs(0), add_profile(0), add_limit(0),
+     index_log(0), get_log_size(0), find_job(0),
+     find_file(0), file_readers(0), job_outputs(0), job_summary(0), find_dir(0), add_dir(0), get_dir(0), get_file(0), find_visible(0), add_visible(0), link_visible(0), get_visible(0),
+     delete_visible(0), find_blob(0), add_blob(0), delete_blobs(0), version(SCHEMA_VERSION), txn_depth(0) { }
 };
 
-Database::Database(bool debugdb) : imp(new detail(debugdb)) { }
+Database::Database(bool debugdb, bool profiledb) : imp(new detail(debugdb, profiledb)) { }
 Database::~Database() { close(); }
 
-std::string Database::open(bool wait, bool memory) {
+// Set by open() under --profile-db; every step below is then timed
+static Database::detail *profiler;
+
+static int step(sqlite3_stmt *stmt) {
+  if (!profiler) return sqlite3_step(stmt);
+
+  // One-off statements (eg: from --db-maintain) are named by their SQL
+  auto it = profiler->names.find(stmt);
+  StatementProfile &prof = it == profiler->names.end()
+    ? profiler->profile[std::string(sqlite3_sql(stmt)).substr(0, 60)]
+    : profiler->profile[it->second];
+
+  // A step of an idle statement starts a new execution
+  if (!sqlite3_stmt_busy(stmt)) {
+    ++prof.calls;
+    prof.current = 0;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = sqlite3_step(stmt);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+  prof.total += seconds;
+  prof.current += seconds;
+  if (prof.current > prof.max) prof.max = prof.current;
+  if (ret == SQLITE_ROW) ++prof.rows;
+  return ret;
+}
+
+static void report_profile(Database::detail *imp) {
+  std::vector<std::pair<std::string, StatementProfile> > rows(imp->profile.begin(), imp->profile.end());
+  std::sort(rows.begin(), rows.end(), [](const std::pair<std::string, StatementProfile> &a, const std::pair<std::string, StatementProfile> &b) {
+    return a.second.total > b.second.total;
+  });
+
+  std::stringstream s;
+  s.setf(std::ios::fixed);
+  s.precision(3);
+  s << "Database statement profile (total ms, calls, rows, max ms):" << std::endl;
+  for (auto &r : rows) {
+    s << "  " << std::setw(11) << r.second.total * 1000
+      << std::setw(10) << r.second.calls
+      << std::setw(11) << r.second.rows
+      << std::setw(10) << r.second.max * 1000
+      << "  " << r.first << std::endl;
+  }
+  std::cerr << s.str();
+  imp->profile.clear();
+}
+
+// Set by open() for a writable database; exit() resolves its open transaction
+static Database::detail *exiting;
+
+static void finish_txn_at_exit() {
+  Database::detail *imp = exiting;
+  if (!imp || !imp->txn_depth) return;
+  // Keep a batch of finished operations, but not one left half done
+  sqlite3_exec(imp->db, imp->txn_depth == 1 ? "commit transaction" : "rollback transaction", 0, 0, 0);
+  imp->txn_depth = 0;
+}
+
+static int read_integer(void *data, int cols, char **text, char **colname) {
+  (void)colname;
+  if (cols >= 1 && text[0]) *static_cast<long*>(data) = atol(text[0]);
+  return 0;
+}
+
+static bool has_table(sqlite3 *db, const char *name) {
+  long count = 0;
+  std::string sql = std::string("select count(*) from sqlite_master where type='table' and name='") + name + "';";
+  sqlite3_exec(db, sql.c_str(), read_integer, &count, 0);
+  return count != 0;
+}
+
+// Tables whose columns changed are renamed aside, so the schema can recreate them.
+// legacy_alter_table keeps foreign keys of other tables pointing at the original name.
+static std::string set_aside(sqlite3 *db, long version) {
+  std::string sql;
+  if (version < 2 && !has_table(db, "files_v1"))
+    sql += "alter table files rename to files_v1; drop index filenames;";
+  if (version < 3 && !has_table(db, "jobs_v2"))
+    sql += "alter table jobs rename to jobs_v2; drop index job;";
+  if (sql.empty()) return "";
+
+  char *fail;
+  sql = "pragma legacy_alter_table=on; begin transaction;" + sql + "commit transaction; pragma legacy_alter_table=off;";
+  if (sqlite3_exec(db, sql.c_str(), 0, 0, &fail) == SQLITE_OK) return "";
+  std::string out = fail;
+  sqlite3_free(fail);
+  sqlite3_exec(db, "rollback transaction;", 0, 0, 0);
+  return out;
+}
+
+static void migrate(Database::detail *imp, long version);
+
+// WAL readers beside a writer need the mmapped -shm index, which is unsafe on NFS
+static bool network_filesystem() {
+#ifdef __linux__
+  struct statfs fs;
+  return statfs(".", &fs) == 0 && fs.f_type == NFS_SUPER_MAGIC;
+#else
+  return false;
+#endif
+}
+
+std::string Database::open(bool wait, bool memory, bool readonly, bool shared) {
   if (imp->db) return "";
   int ret;
 
-  ret = sqlite3_open_v2(memory?":memory:":"wake.db", &imp->db, SQLITE_OPEN_READWRITE, 0);
+  if (shared && !memory && !readonly && network_filesystem()) {
+    std::cerr << "wake.db is on a network filesystem; ignoring --shared-db" << std::endl;
+    shared = false;
+  }
+
+  // Writers exclude each other with flock. Unless shared, the writer also keeps
+  // locking_mode=exclusive, which is then the real guard if flock is unsupported.
+  if (!memory && !readonly) {
+    imp->lockfd = ::open("wake.db", O_RDONLY|O_CLOEXEC);
+    if (imp->lockfd == -1) return std::string("open wake.db: ") + strerror(errno);
+    while (flock(imp->lockfd, LOCK_EX|LOCK_NB) != 0) {
+      if (errno == EINTR) continue;
+      if (!shared && errno != EWOULDBLOCK) break;
+      if (!wait || errno != EWOULDBLOCK) {
+        std::string out = std::string("flock wake.db: ") + strerror(errno);
+        close();
+        return out;
+      }
+      std::cerr << "Database wake.db is busy; waiting 1 second ..." << std::endl;
+      sleep(1);
+    }
+  }
+
+  ret = sqlite3_open_v2(memory?":memory:":"wake.db", &imp->db, readonly?SQLITE_OPEN_READONLY:SQLITE_OPEN_READWRITE, 0);
   if (ret != SQLITE_OK) {
     if (!imp->db) return "sqlite3_open: out of memory";
     std::string out = sqlite3_errmsg(imp->db);
@@ -86,17 +322,49 @@ std::string Database::open(bool wait, bool memory) {
   }
 
 #if SQLITE_VERSION_NUMBER >= 3007011
-  if (sqlite3_db_readonly(imp->db, 0)) {
+  if (!readonly && sqlite3_db_readonly(imp->db, 0)) {
     return "read-only";
   }
 #endif
 
+  // Must precede the first read, so that SQLite never maps the WAL index in -shm
+  if (!readonly && !shared) sqlite3_exec(imp->db, "pragma locking_mode=exclusive;", 0, 0, 0);
+
+  // A reader only waits out the writer's brief checkpoints and commits
+  if (readonly) sqlite3_busy_timeout(imp->db, 10000);
+
+  // An older wake.db is migrated in place by the first build to open it
+  long version = 0, tables = 0;
+  sqlite3_exec(imp->db, "pragma user_version;", read_integer, &version, 0);
+  ret = sqlite3_exec(imp->db, "select count(*) from sqlite_master;", read_integer, &tables, 0);
+  if (readonly && ret == SQLITE_BUSY) {
+    close();
+    return "a build holds wake.db exclusively; run it with --shared-db to inspect it meanwhile";
+  }
+  // A new wake.db is just stamped with the current version
+  if (!tables && !readonly) sqlite3_exec(imp->db, "pragma user_version=" TOSTRING(SCHEMA_VERSION) ";", 0, 0, 0);
+  if (!tables) version = SCHEMA_VERSION;
+  if (version != SCHEMA_VERSION && (readonly || version > SCHEMA_VERSION)) {
+    std::stringstream s;
+    s << "schema version " << version << " is not " << SCHEMA_VERSION;
+    if (version < SCHEMA_VERSION) s << "; run a build to upgrade it";
+    close();
+    return s.str();
+  }
+  if (!readonly && version < SCHEMA_VERSION) {
+    std::string fail = set_aside(imp->db, version);
+    if (!fail.empty()) {
+      close();
+      return "could not migrate wake.db: " + fail;
+    }
+  }
+
   const char *schema_sql =
     "pragma auto_vacuum=incremental;"
     "pragma journal_mode=wal;"
     "pragma synchronous=0;"
-    "pragma locking_mode=exclusive;"
     "pragma foreign_keys=on;"
+    "drop table if exists typecache;" // left behind by --type-cache
     "create table if not exists targets("
     "  expression text primary key);"
     "create table if not exists entropy("
@@ -105,12 +373,27 @@ std::string Database::open(bool wait, bool memory) {
     "create table if not exists runs("
     "  run_id integer primary key autoincrement,"
     "  time   text    not null default current_timestamp);"
+    "create table if not exists limits(" // job limit changes made by --pressure
+    "  limit_id integer primary key autoincrement,"
+    "  run_id   integer not null references runs(run_id) on delete cascade,"
+    "  time     text    not null default current_timestamp,"
+    "  cpu      real    not null," // PSI 'some avg10' stall percentages
+    "  memory   real    not null,"
+    "  io       real    not null,"
+    "  old      real    not null," // CPUs
+    "  new      real    not null);"
+    "create table if not exists dirs(" // a/b/c is (a, b under a, c under b)
+    "  dir_id    integer primary key,"
+    "  parent_id integer not null," // 0 = the workspace; '/' starts with an empty name
+    "  name      text    not null);"
+    "create unique index if not exists dirnames on dirs(parent_id, name);"
     "create table if not exists files("
     "  file_id  integer primary key,"
-    "  path     text    not null,"
+    "  dir_id   integer not null,"
+    "  name     text    not null,"
     "  hash     text    not null,"
     "  modified integer not null);"
-    "create unique index if not exists filenames on files(path);"
+    "create unique index if not exists filenames on files(dir_id, name);"
     "create table if not exists stats("
     "  stat_id    integer primary key autoincrement,"
     "  hashcode   integer not null," // on collision, prefer largest stat_id (ie: newest)
@@ -122,22 +405,31 @@ std::string Database::open(bool wait, bool memory) {
     "  obytes     integer not null,"
     "  pathtime   real);"
     "create index if not exists stathash on stats(hashcode);"
+    "create table if not exists profiles("
+    "  stat_id  integer primary key references stats(stat_id) on delete cascade,"
+    "  interval real    not null," // seconds between samples
+    "  samples  blob    not null);" // (KiB resident, centi-cores busy) as little-endian uint32 pairs
+    "create table if not exists blobs(" // environments and stacks, shared by every job with the same one
+    "  blob_id  integer primary key autoincrement,"
+    "  hashcode integer not null,"
+    "  content  blob    not null);"
+    "create index if not exists blobhash on blobs(hashcode);"
     "create table if not exists jobs("
     "  job_id      integer primary key autoincrement,"
     "  run_id      integer not null references runs(run_id),"
     "  use_id      integer not null references runs(run_id),"
     "  directory   text    not null,"
     "  commandline blob    not null,"
-    "  environment blob    not null,"
-    "  stack       blob    not null,"
+    "  env_id      integer not null references blobs(blob_id),"
+    "  stack_id    integer not null references blobs(blob_id),"
     "  stdin       text    not null," // might point outside the workspace
     "  stat_id     integer references stats(stat_id)," // null if unmerged
     "  endtime     text    not null default '',"
     "  keep        integer not null default 0);"       // 0=false, 1=true
-    "create index if not exists job on jobs(directory, commandline, environment, stdin, keep, job_id, stat_id);"
+    "create index if not exists job on jobs(directory, commandline, env_id, stdin, keep, job_id, stat_id);"
     "create table if not exists filetree("
     "  tree_id  integer primary key autoincrement,"
-    "  access   integer not null," // 0=visible, 1=input, 2=output
+    "  access   integer not null," // 1=input, 2=output; visible sets live in jobvisible
     "  job_id   integer not null references jobs(job_id) on delete cascade,"
     "  file_id  integer not null references files(file_id),"
     "  unique(job_id, access, file_id) on conflict ignore);"
@@ -148,7 +440,25 @@ std::string Database::open(bool wait, bool memory) {
     "  descriptor integer not null," // 1=stdout, 2=stderr"
     "  seconds    real    not null," // seconds after job start
     "  output     text    not null);"
-    "create index if not exists logorder on log(job_id, descriptor, log_id);";
+    "create index if not exists logorder on log(job_id, descriptor, log_id);"
+    "create table if not exists logindex(" // output captured in Database::output_file
+    "  index_id   integer primary key autoincrement,"
+    "  job_id     integer not null references jobs(job_id) on delete cascade,"
+    "  descriptor integer not null," // 1=stdout, 2=stderr"
+    "  seconds    real    not null," // seconds after job start
+    "  offset     integer not null);" // bytes of the file written by then
+    "create index if not exists logindexorder on logindex(job_id, descriptor, offset);"
+    "create table if not exists visibles(" // shared by every job which sees the same files
+    "  set_id   integer primary key autoincrement,"
+    "  hashcode integer not null,"
+    "  files    blob    not null);" // sorted file_ids as varint gaps
+    "create index if not exists visiblehash on visibles(hashcode);"
+    "create table if not exists jobvisible("
+    "  job_id integer primary key references jobs(job_id) on delete cascade,"
+    "  set_id integer not null references visibles(set_id));"
+    "create index if not exists visibleuse on jobvisible(set_id);";
+
+  if (readonly) schema_sql = "pragma query_only=on;";
 
   while (true) {
     char *fail;
@@ -175,61 +485,108 @@ std::string Database::open(bool wait, bool memory) {
   const char *sql_begin_txn = "begin transaction";
   const char *sql_commit_txn = "commit transaction";
   const char *sql_predict_job =
-    "select status, runtime, cputime, membytes, ibytes, obytes, pathtime"
-    " from stats where hashcode=? order by stat_id desc limit 1";
+    "select s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes, s.pathtime, p.interval, p.samples"
+    " from stats s left join profiles p on p.stat_id=s.stat_id"
+    " where s.hashcode=? order by s.stat_id desc limit 1";
   const char *sql_stats_job =
     "select status, runtime, cputime, membytes, ibytes, obytes, pathtime"
     " from stats where stat_id=?";
   const char *sql_insert_job =
-    "insert into jobs(run_id, use_id, directory, commandline, environment, stack, stdin)"
+    "insert into jobs(run_id, use_id, directory, commandline, env_id, stack_id, stdin)"
     " values(?, ?1, ?, ?, ?, ?, ?)";
   const char *sql_insert_tree =
     "insert into filetree(access, job_id, file_id)"
-    " values(?, ?, (select file_id from files where path=?))";
+    " values(?, ?, ?)";
+  std::string sql_insert_trees = "insert into filetree(access, job_id, file_id) values";
+  for (int i = 0; i < TREE_BATCH; ++i) {
+    sql_insert_trees += i ? ", " : " ";
+    sql_insert_trees += "(?1, ?2, ?" + std::to_string(i+3) + ")";
+  }
   const char *sql_insert_log =
     "insert into log(job_id, descriptor, seconds, output)"
     " values(?, ?, ?, ?)";
   const char *sql_wipe_file =
     "delete from jobs where job_id in"
     " (select t.job_id from files f, filetree t"
-    "  where f.path=? and f.hash<>? and t.file_id=f.file_id and t.access=1)";
+    "  where f.dir_id=? and f.name=? and f.hash<>? and t.file_id=f.file_id and t.access=1)";
   const char *sql_insert_file =
-    "insert or ignore into files(hash, modified, path) values (?, ?, ?)";
+    "insert or ignore into files(hash, modified, dir_id, name) values (?, ?, ?, ?)";
   const char *sql_update_file =
-    "update files set hash=?, modified=? where path=?";
+    "update files set hash=?, modified=? where dir_id=? and name=?";
   const char *sql_get_log =
     "select output from log where job_id=? and descriptor=? order by log_id";
+  const char *sql_index_log =
+    "insert into logindex(job_id, descriptor, seconds, offset)"
+    " values(?, ?, ?, ?)";
+  const char *sql_get_log_size =
+    "select max(offset) from logindex where job_id=? and descriptor=?";
+  const char *sql_find_job =
+    "select 1 from jobs where job_id=?";
+  const char *sql_find_file =
+    "select file_id from files where dir_id=? and name=?";
+  const char *sql_file_readers = // filesearch index
+    "select job_id from filetree where file_id=? and access=1";
+  const char *sql_job_outputs = // filetree's unique(job_id, access, file_id) index
+    "select file_id from filetree where job_id=? and access=2";
+  const char *sql_job_summary =
+    "select j.commandline, coalesce(s.runtime, 0) from jobs j left join stats s on s.stat_id=j.stat_id"
+    " where j.job_id=?";
+  const char *sql_find_dir =
+    "select dir_id from dirs where parent_id=? and name=?";
+  const char *sql_add_dir =
+    "insert into dirs(parent_id, name) values(?, ?)";
+  const char *sql_get_dir =
+    "select parent_id, name from dirs where dir_id=?";
+  const char *sql_get_file =
+    "select dir_id, name, hash from files where file_id=?";
+  const char *sql_find_blob =
+    "select blob_id, content from blobs where hashcode=?";
+  const char *sql_add_blob =
+    "insert into blobs(hashcode, content) values(?, ?)";
+  const char *sql_delete_blobs =
+    "delete from blobs where blob_id not in (select env_id from jobs union all select stack_id from jobs)";
+  const char *sql_find_visible =
+    "select set_id, files from visibles where hashcode=?";
+  const char *sql_add_visible =
+    "insert into visibles(hashcode, files) values(?, ?)";
+  const char *sql_link_visible =
+    "insert into jobvisible(job_id, set_id) values(?, ?)";
+  const char *sql_get_visible =
+    "select v.files from jobvisible j, visibles v where j.job_id=? and v.set_id=j.set_id";
+  const char *sql_delete_visible =
+    "delete from visibles where set_id not in (select set_id from jobvisible)";
   const char *sql_get_tree =
-    "select f.path, f.hash from filetree t, files f"
+    "select f.dir_id, f.name, f.hash, f.file_id from filetree t, files f"
     " where t.job_id=? and t.access=? and f.file_id=t.file_id order by t.tree_id";
   const char *sql_add_stats =
     "insert into stats(hashcode, status, runtime, cputime, membytes, ibytes, obytes)"
     " values(?, ?, ?, ?, ?, ?, ?)";
+  const char *sql_add_profile =
+    "insert into profiles(stat_id, interval, samples) values(?, ?, ?)";
+  const char *sql_add_limit =
+    "insert into limits(run_id, cpu, memory, io, old, new) values(?, ?, ?, ?, ?, ?)";
   const char *sql_link_stats =
     "update jobs set stat_id=?, endtime=current_timestamp, keep=? where job_id=?";
-  const char *sql_detect_overlap =
-    "select f.path from filetree t1, filetree t2, files f"
-    " where t1.job_id=?1 and t1.access=2 and t2.file_id=t1.file_id and t2.access=2 and t2.job_id<>?1 and f.file_id=t1.file_id";
-  const char *sql_delete_overlap =
-    "delete from jobs where use_id<>? and job_id in "
-    "(select t2.job_id from filetree t1, filetree t2"
-    "  where t1.job_id=?2 and t1.access=2 and t2.file_id=t1.file_id and t2.access=2 and t2.job_id<>?2)";
+  const char *sql_delete_overlap = // jobs of older runs which also wrote file_id ?2
+    "delete from jobs where use_id<>?1 and job_id in"
+    " (select job_id from filetree where file_id=?2 and access=2)";
   const char *sql_find_prior =
     "select job_id, stat_id from jobs where "
-    "directory=? and commandline=? and environment=? and stdin=? and keep=1";
+    "directory=? and commandline=? and env_id=? and stdin=? and keep=1";
   const char *sql_update_prior =
     "update jobs set use_id=? where job_id=?";
   const char *sql_delete_prior =
     "delete from jobs where use_id<>?1 and job_id in"
     " (select j2.job_id from jobs j1, jobs j2"
     "  where j1.job_id=?2 and j1.directory=j2.directory and j1.commandline=j2.commandline"
-    "  and j1.environment=j2.environment and j1.stdin=j2.stdin and j2.job_id<>?2)";
+    "  and j1.env_id=j2.env_id and j1.stdin=j2.stdin and j2.job_id<>?2)";
   const char *sql_find_owner =
-    "select j.job_id, j.directory, j.commandline, j.environment, j.stack, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
-    " from files f, filetree t, jobs j left join stats s on j.stat_id=s.stat_id"
-    " where f.path=? and t.file_id=f.file_id and t.access=? and j.job_id=t.job_id";
+    "select j.job_id, j.directory, j.commandline, e.content, k.content, j.stdin, j.endtime, s.status, s.runtime, s.cputime, s.membytes, s.ibytes, s.obytes"
+    " from files f, filetree t, blobs e, blobs k, jobs j left join stats s on j.stat_id=s.stat_id"
+    " where f.dir_id=? and f.name=? and t.file_id=f.file_id and t.access=? and j.job_id=t.job_id"
+    " and e.blob_id=j.env_id and k.blob_id=j.stack_id";
   const char *sql_fetch_hash =
-    "select hash from files where path=? and modified=?";
+    "select hash from files where dir_id=? and name=? and modified=?";
   const char *sql_delete_jobs =
     "delete from jobs where job_id in"
     " (select job_id from jobs where keep=0 except select job_id from filetree where access=2)";
@@ -249,6 +606,13 @@ std::string Database::open(bool wait, bool memory) {
     "  select coalesce(max(s.pathtime),0) from filetree f1, filetree f2, jobs j, stats s"
     "  where f1.job_id=?1 and f1.access=2 and f1.file_id=f2.file_id and f2.access=1 and f2.job_id=j.job_id and j.stat_id=s.stat_id"
     ") where stat_id=(select stat_id from jobs where job_id=?1);";
+  const char *sql_last_crit =
+    "select coalesce(max(s.pathtime),0) from jobs j, stats s"
+    " where j.use_id=(select max(run_id) from runs) and s.stat_id=j.stat_id";
+  const char *sql_last_inputs =
+    "select t.job_id, f.dir_id, f.name, f.modified from jobs j, filetree t, files f"
+    " where j.use_id=(select max(run_id) from runs) and t.job_id=j.job_id and t.access=1 and f.file_id=t.file_id"
+    " order by t.job_id";
 
 #define PREPARE(sql, member)										\
   ret = sqlite3_prepare_v2(imp->db, sql, -1, &imp->member, 0);						\
@@ -256,7 +620,8 @@ std::string Database::open(bool wait, bool memory) {
     std::string out = std::string("sqlite3_prepare_v2 " #member ": ") + sqlite3_errmsg(imp->db);	\
     close();												\
     return out;												\
-  }
+  }													\
+  imp->names[imp->member] = #member
 
   PREPARE(sql_get_entropy,    get_entropy);
   PREPARE(sql_set_entropy,    set_entropy);
@@ -268,6 +633,7 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_stats_job,      stats_job);
   PREPARE(sql_insert_job,     insert_job);
   PREPARE(sql_insert_tree,    insert_tree);
+  PREPARE(sql_insert_trees.c_str(), insert_trees);
   PREPARE(sql_insert_log,     insert_log);
   PREPARE(sql_wipe_file,      wipe_file);
   PREPARE(sql_insert_file,    insert_file);
@@ -276,7 +642,6 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_get_tree,       get_tree);
   PREPARE(sql_add_stats,      add_stats);
   PREPARE(sql_link_stats,     link_stats);
-  PREPARE(sql_detect_overlap, detect_overlap);
   PREPARE(sql_delete_overlap, delete_overlap);
   PREPARE(sql_find_prior,     find_prior);
   PREPARE(sql_update_prior,   update_prior);
@@ -288,6 +653,40 @@ std::string Database::open(bool wait, bool memory) {
   PREPARE(sql_delete_stats,   delete_stats);
   PREPARE(sql_revtop_order,   revtop_order);
   PREPARE(sql_setcrit_path,   setcrit_path);
+  PREPARE(sql_last_crit,      last_crit);
+  PREPARE(sql_last_inputs,    last_inputs);
+  PREPARE(sql_add_profile,    add_profile);
+  PREPARE(sql_add_limit,      add_limit);
+  PREPARE(sql_index_log,      index_log);
+  PREPARE(sql_get_log_size,   get_log_size);
+  PREPARE(sql_find_job,       find_job);
+  PREPARE(sql_find_file,      find_file);
+  PREPARE(sql_file_readers,   file_readers);
+  PREPARE(sql_job_outputs,    job_outputs);
+  PREPARE(sql_job_summary,    job_summary);
+  PREPARE(sql_find_dir,       find_dir);
+  PREPARE(sql_add_dir,        add_dir);
+  PREPARE(sql_get_dir,        get_dir);
+  PREPARE(sql_get_file,       get_file);
+  PREPARE(sql_find_visible,   find_visible);
+  PREPARE(sql_add_visible,    add_visible);
+  PREPARE(sql_link_visible,   link_visible);
+  PREPARE(sql_get_visible,    get_visible);
+  PREPARE(sql_delete_visible, delete_visible);
+  PREPARE(sql_find_blob,      find_blob);
+  PREPARE(sql_add_blob,       add_blob);
+  PREPARE(sql_delete_blobs,   delete_blobs);
+
+  if (imp->profiledb) profiler = imp.get();
+
+  imp->version = version;
+
+  if (!readonly) {
+    static bool registered = false;
+    if (!registered) atexit(finish_txn_at_exit);
+    registered = true;
+    exiting = imp.get();
+  }
 
   return "";
 }
@@ -295,6 +694,10 @@ std::string Database::open(bool wait, bool memory) {
 void Database::close() {
   int ret;
 
+  if (profiler == imp.get()) profiler = 0;
+  if (exiting == imp.get()) exiting = 0;
+  if (!imp->profile.empty()) report_profile(imp.get());
+
 #define FINALIZE(member)						\
   if  (imp->member) {							\
     ret = sqlite3_finalize(imp->member);				\
@@ -316,6 +719,7 @@ void Database::close() {
   FINALIZE(stats_job);
   FINALIZE(insert_job);
   FINALIZE(insert_tree);
+  FINALIZE(insert_trees);
   FINALIZE(insert_log);
   FINALIZE(wipe_file);
   FINALIZE(insert_file);
@@ -324,7 +728,6 @@ void Database::close() {
   FINALIZE(get_tree);
   FINALIZE(add_stats);
   FINALIZE(link_stats);
-  FINALIZE(detect_overlap);
   FINALIZE(delete_overlap);
   FINALIZE(find_prior);
   FINALIZE(update_prior);
@@ -336,6 +739,29 @@ void Database::close() {
   FINALIZE(delete_stats);
   FINALIZE(revtop_order);
   FINALIZE(setcrit_path);
+  FINALIZE(last_crit);
+  FINALIZE(last_inputs);
+  FINALIZE(add_profile);
+  FINALIZE(add_limit);
+  FINALIZE(index_log);
+  FINALIZE(get_log_size);
+  FINALIZE(find_job);
+  FINALIZE(find_file);
+  FINALIZE(file_readers);
+  FINALIZE(job_outputs);
+  FINALIZE(job_summary);
+  FINALIZE(find_dir);
+  FINALIZE(add_dir);
+  FINALIZE(get_dir);
+  FINALIZE(get_file);
+  FINALIZE(find_visible);
+  FINALIZE(add_visible);
+  FINALIZE(link_visible);
+  FINALIZE(get_visible);
+  FINALIZE(delete_visible);
+  FINALIZE(find_blob);
+  FINALIZE(add_blob);
+  FINALIZE(delete_blobs);
 
   if (imp->db) {
     int ret = sqlite3_close(imp->db);
@@ -345,6 +771,8 @@ void Database::close() {
     }
   }
   imp->db = 0;
+  if (imp->lockfd != -1) ::close(imp->lockfd);
+  imp->lockfd = -1;
 }
 
 static int fill_vector(void *data, int cols, char **text, char **colname) {
@@ -390,7 +818,7 @@ static void finish_stmt(const char *why, sqlite3_stmt *stmt, bool debug) {
 static void single_step(const char *why, sqlite3_stmt *stmt, bool debug) {
   int ret;
 
-  ret = sqlite3_step(stmt);
+  ret = step(stmt);
   if (ret != SQLITE_DONE) {
     std::cerr << why << "; sqlite3_step: " << sqlite3_errmsg(sqlite3_db_handle(stmt)) << std::endl;
     std::cerr << "The failing statement was: ";
@@ -458,6 +886,84 @@ static std::string rip_column(sqlite3_stmt *stmt, int col) {
     sqlite3_column_bytes(stmt, col));
 }
 
+// Paths are interned a directory at a time; prefix is "" (dir 0) or ends in '/'
+static long intern_dir(Database::detail *imp, const char *why, const std::string &prefix, bool create) {
+  if (prefix.empty()) return 0;
+  auto it = imp->dir_ids.find(prefix);
+  if (it != imp->dir_ids.end()) return it->second;
+
+  size_t slash = prefix.size() < 2 ? std::string::npos : prefix.rfind('/', prefix.size()-2);
+  size_t start = slash == std::string::npos ? 0 : slash+1;
+  long parent = intern_dir(imp, why, prefix.substr(0, start), create);
+  if (parent == -1) return -1;
+
+  long dir = -1;
+  bind_integer(why, imp->find_dir, 1, parent);
+  bind_string (why, imp->find_dir, 2, prefix.c_str()+start, prefix.size()-1-start);
+  if (step(imp->find_dir) == SQLITE_ROW) dir = sqlite3_column_int64(imp->find_dir, 0);
+  finish_stmt(why, imp->find_dir, imp->debugdb);
+
+  if (dir == -1) {
+    if (!create) return -1;
+    bind_integer(why, imp->add_dir, 1, parent);
+    bind_string (why, imp->add_dir, 2, prefix.c_str()+start, prefix.size()-1-start);
+    single_step (why, imp->add_dir, imp->debugdb);
+    dir = sqlite3_last_insert_rowid(imp->db);
+  }
+
+  imp->dir_ids.emplace(prefix, dir);
+  return dir;
+}
+
+// Bind path as (dir_id, name) at index and index+1; an unknown directory matches nothing
+static void bind_path(Database::detail *imp, const char *why, sqlite3_stmt *stmt, int index, const std::string &path, bool create = false) {
+  size_t slash = path.rfind('/');
+  size_t start = slash == std::string::npos ? 0 : slash+1;
+  bind_integer(why, stmt, index, intern_dir(imp, why, path.substr(0, start), create));
+  bind_string (why, stmt, index+1, path.c_str()+start, path.size()-start);
+}
+
+static const std::string &dir_path(Database::detail *imp, const char *why, long dir) {
+  static const std::string root;
+  if (dir == 0) return root;
+  auto it = imp->dir_paths.find(dir);
+  if (it != imp->dir_paths.end()) return it->second;
+
+  long parent = 0;
+  std::string name;
+  bind_integer(why, imp->get_dir, 1, dir);
+  if (step(imp->get_dir) == SQLITE_ROW) {
+    parent = sqlite3_column_int64(imp->get_dir, 0);
+    name = rip_column(imp->get_dir, 1);
+  }
+  finish_stmt(why, imp->get_dir, imp->debugdb);
+
+  std::string path = dir_path(imp, why, parent) + name + "/";
+  return imp->dir_paths.emplace(dir, std::move(path)).first->second;
+}
+
+// Rebuild the path selected as (dir_id, name) in columns col and col+1
+static std::string rip_path(Database::detail *imp, const char *why, sqlite3_stmt *stmt, int col) {
+  return dir_path(imp, why, sqlite3_column_int64(stmt, col)) + rip_column(stmt, col+1);
+}
+
+static long find_file_id(Database::detail *imp, const char *why, const std::string &path) {
+  auto it = imp->file_ids.find(path);
+  if (it != imp->file_ids.end()) return it->second;
+
+  long id = -1;
+  bind_path(imp, why, imp->find_file, 1, path);
+  if (step(imp->find_file) == SQLITE_ROW) id = sqlite3_column_int64(imp->find_file, 0);
+  finish_stmt(why, imp->find_file, imp->debugdb);
+  if (id == -1) {
+    std::cerr << why << "; file " << path << " was never hashed" << std::endl;
+    exit(1);
+  }
+
+  imp->file_ids.emplace(path, id);
+  return id;
+}
+
 void Database::entropy(uint64_t *key, int words) {
   const char *why = "Could not restore entropy";
   int word;
@@ -466,7 +972,7 @@ void Database::entropy(uint64_t *key, int words) {
 
   // Use entropy from DB
   for (word = 0; word < words; ++word) {
-    if (sqlite3_step(imp->get_entropy) != SQLITE_ROW) break;
+    if (step(imp->get_entropy) != SQLITE_ROW) break;
     key[word] = sqlite3_column_int64(imp->get_entropy, 0);
   }
   finish_stmt(why, imp->get_entropy, imp->debugdb);
@@ -478,6 +984,12 @@ void Database::entropy(uint64_t *key, int words) {
   }
 
   end_txn();
+
+  // Migrated blobs and visible sets are hashed like new ones, so this needs the key
+  if (imp->version != SCHEMA_VERSION) {
+    migrate(imp.get(), imp->version);
+    imp->version = SCHEMA_VERSION;
+  }
 }
 
 std::vector<std::string> Database::get_targets() {
@@ -502,6 +1014,30 @@ void Database::del_target(const std::string &target) {
   single_step(why, imp->del_target, imp->debugdb);
 }
 
+double Database::lookahead(std::vector<std::vector<FileStamp> > &inputs) {
+  const char *why = "Could not inspect the previous run";
+  double crit = 0;
+
+  begin_txn();
+  if (step(imp->last_crit) == SQLITE_ROW)
+    crit = sqlite3_column_double(imp->last_crit, 0);
+  finish_stmt(why, imp->last_crit, imp->debugdb);
+
+  long last = -1;
+  while (step(imp->last_inputs) == SQLITE_ROW) {
+    long job = sqlite3_column_int64(imp->last_inputs, 0);
+    if (job != last) inputs.resize(inputs.size()+1);
+    last = job;
+    inputs.back().emplace_back(
+      rip_path(imp.get(), why, imp->last_inputs, 1),
+      sqlite3_column_int64(imp->last_inputs, 3));
+  }
+  finish_stmt(why, imp->last_inputs, imp->debugdb);
+  end_txn();
+
+  return crit;
+}
+
 void Database::prepare() {
   std::vector<std::string> out;
   const char *sql = "insert into runs(run_id) values(null);";
@@ -513,19 +1049,41 @@ void Database::prepare() {
   imp->run_id = sqlite3_last_insert_rowid(imp->db);
 }
 
+// Delete jobs nobody wants, surplus stats, orphaned visible sets and blobs, and their captured output
+static void sweep(Database::detail *imp) {
+  single_step("Could not clean database jobs",  imp->delete_jobs,  imp->debugdb);
+  single_step("Could not clean database dups",  imp->delete_dups,  imp->debugdb);
+  single_step("Could not clean database stats", imp->delete_stats, imp->debugdb);
+  single_step("Could not clean visible sets",   imp->delete_visible, imp->debugdb);
+  single_step("Could not clean database blobs", imp->delete_blobs, imp->debugdb);
+
+  // Remove captured output of jobs which no longer exist
+  if (DIR *dir = opendir(OUTPUT_DIR)) {
+    const char *why = "Could not clean captured output";
+    while (struct dirent *f = readdir(dir)) {
+      char *end;
+      long job = strtol(f->d_name, &end, 10);
+      if (end == f->d_name || *end != '.') continue;
+      bind_integer(why, imp->find_job, 1, job);
+      bool live = step(imp->find_job) == SQLITE_ROW;
+      finish_stmt(why, imp->find_job, imp->debugdb);
+      if (!live) unlink((std::string(OUTPUT_DIR "/") + f->d_name).c_str());
+    }
+    closedir(dir);
+  }
+}
+
 void Database::clean() {
   const char *why = "Could not compute critical path";
   begin_txn();
-  while (sqlite3_step(imp->revtop_order) == SQLITE_ROW) {
+  while (step(imp->revtop_order) == SQLITE_ROW) {
     bind_integer(why, imp->setcrit_path, 1, sqlite3_column_int64(imp->revtop_order, 0));
     single_step(why, imp->setcrit_path, imp->debugdb);
   }
   finish_stmt(why, imp->revtop_order, imp->debugdb);
   end_txn();
 
-  single_step("Could not clean database jobs",  imp->delete_jobs,  imp->debugdb);
-  single_step("Could not clean database dups",  imp->delete_dups,  imp->debugdb);
-  single_step("Could not clean database stats", imp->delete_stats, imp->debugdb);
+  sweep(imp.get());
 
   // This cannot be a prepared statement, because pragmas may run on prepare
   char *fail;
@@ -534,12 +1092,274 @@ void Database::clean() {
     std::cerr << "Could not recover space: " << fail << std::endl;
 }
 
+static sqlite3_stmt *prepare_once(Database::detail *imp, const char *why, const char *sql) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(imp->db, sql, -1, &stmt, 0) != SQLITE_OK) {
+    std::cerr << why << "; sqlite3_prepare_v2: " << sqlite3_errmsg(imp->db) << std::endl;
+    exit(1);
+  }
+  return stmt;
+}
+
+static int64_t query_integer(Database::detail *imp, const char *why, const char *sql) {
+  sqlite3_stmt *stmt = prepare_once(imp, why, sql);
+  int64_t out = step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+  finish_stmt(why, stmt, imp->debugdb);
+  sqlite3_finalize(stmt);
+  return out;
+}
+
+static std::string pretty_bytes(double bytes) {
+  static const char *unit[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+  int u = 0;
+  while (bytes >= 1024 && u < 4) { bytes /= 1024; ++u; }
+  std::stringstream s;
+  s.precision(u ? 1 : 0);
+  s << std::fixed << bytes << " " << unit[u];
+  return s.str();
+}
+
+static void report_size(Database::detail *imp) {
+  const char *why = "Could not measure the database";
+  int64_t page = query_integer(imp, why, "pragma page_size");
+  int64_t pages = query_integer(imp, why, "pragma page_count");
+  int64_t free = query_integer(imp, why, "pragma freelist_count");
+  struct stat wal;
+  if (stat("wake.db-wal", &wal) != 0) wal.st_size = 0;
+  std::cout
+    << "  Database: " << pretty_bytes(page*pages)
+    << " (" << pretty_bytes(page*free) << " free), write-ahead log: "
+    << pretty_bytes(wal.st_size) << std::endl;
+}
+
+void Database::maintain(int runs, double days, double budget) {
+  const char *why = "Could not report database usage";
+  std::vector<std::string> tables;
+  sqlite3_stmt *stmt = prepare_once(imp.get(), why,
+    "select name from sqlite_master where type='table' and name not like 'sqlite_%' order by name");
+  while (step(stmt) == SQLITE_ROW) tables.push_back(rip_column(stmt, 0));
+  finish_stmt(why, stmt, imp->debugdb);
+  sqlite3_finalize(stmt);
+
+  // Per-table sizes need sqlite built with SQLITE_ENABLE_DBSTAT_VTAB
+  std::unordered_map<std::string, int64_t> bytes;
+  if (sqlite3_prepare_v2(imp->db, "select name, sum(pgsize) from dbstat group by name", -1, &stmt, 0) == SQLITE_OK) {
+    while (step(stmt) == SQLITE_ROW)
+      bytes[rip_column(stmt, 0)] = sqlite3_column_int64(stmt, 1);
+    finish_stmt(why, stmt, imp->debugdb);
+    sqlite3_finalize(stmt);
+  }
+
+  std::cout << "Database usage:" << std::endl;
+  for (auto &table : tables) {
+    std::string count = "select count(*) from \"" + table + "\"";
+    std::cout << "  " << table << ": " << query_integer(imp.get(), why, count.c_str()) << " rows";
+    auto it = bytes.find(table);
+    if (it != bytes.end()) std::cout << ", " << pretty_bytes(it->second);
+    std::cout << std::endl;
+  }
+  report_size(imp.get());
+
+  if (runs > 0 || days > 0) {
+    why = "Could not apply the retention policy";
+    int64_t cutoff = 0;
+    if (runs > 0) {
+      stmt = prepare_once(imp.get(), why,
+        "select coalesce(min(run_id), 0) from (select run_id from runs order by run_id desc limit ?)");
+      bind_integer(why, stmt, 1, runs);
+      if (step(stmt) == SQLITE_ROW) cutoff = sqlite3_column_int64(stmt, 0);
+      finish_stmt(why, stmt, imp->debugdb);
+      sqlite3_finalize(stmt);
+    }
+    if (days > 0) {
+      stmt = prepare_once(imp.get(), why,
+        "select coalesce(min(run_id), (select max(run_id)+1 from runs)) from runs"
+        " where time >= datetime('now', '-' || ? || ' seconds')");
+      bind_integer(why, stmt, 1, (long)(days * 86400));
+      if (step(stmt) == SQLITE_ROW) cutoff = std::max(cutoff, (int64_t)sqlite3_column_int64(stmt, 0));
+      finish_stmt(why, stmt, imp->debugdb);
+      sqlite3_finalize(stmt);
+    }
+
+    // Unkept jobs (and their logs) not used since the cutoff run go; kept jobs are the cache
+    begin_txn();
+    stmt = prepare_once(imp.get(), why, "delete from jobs where keep=0 and use_id<?");
+    bind_integer(why, stmt, 1, cutoff);
+    single_step(why, stmt, imp->debugdb);
+    sqlite3_finalize(stmt);
+    int jobs = sqlite3_changes(imp->db);
+    stmt = prepare_once(imp.get(), why,
+      "delete from runs where run_id<?1 and run_id not in"
+      " (select run_id from jobs union select use_id from jobs)");
+    bind_integer(why, stmt, 1, cutoff);
+    single_step(why, stmt, imp->debugdb);
+    sqlite3_finalize(stmt);
+    int old = sqlite3_changes(imp->db);
+    sweep(imp.get());
+    end_txn();
+    std::cout << "Retention removed " << jobs << " jobs and " << old << " runs" << std::endl;
+  }
+
+  // Return free pages in slices, so a huge database cannot stall maintenance indefinitely
+  why = "Could not recover space";
+  struct timeval start, now;
+  gettimeofday(&start, 0);
+  int64_t before = query_integer(imp.get(), why, "pragma freelist_count");
+  int64_t free = before;
+  double elapsed = 0;
+  while (free > 0 && elapsed < budget) {
+    char *fail;
+    if (sqlite3_exec(imp->db, "pragma incremental_vacuum(" VACUUM_SLICE ");", 0, 0, &fail) != SQLITE_OK) {
+      std::cerr << why << ": " << fail << std::endl;
+      sqlite3_free(fail);
+      break;
+    }
+    int64_t left = query_integer(imp.get(), why, "pragma freelist_count");
+    if (left >= free) break;
+    free = left;
+    gettimeofday(&now, 0);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+  }
+  int64_t page = query_integer(imp.get(), why, "pragma page_size");
+  std::cout << "Vacuum returned " << pretty_bytes((before - free) * page);
+  if (free > 0) std::cout << "; " << pretty_bytes(free * page) << " remain for the next run";
+  std::cout << std::endl;
+
+  why = "Could not checkpoint the write-ahead log";
+  char *fail;
+  if (sqlite3_exec(imp->db, "pragma wal_checkpoint(TRUNCATE);", 0, 0, &fail) != SQLITE_OK) {
+    std::cerr << why << ": " << fail << std::endl;
+    sqlite3_free(fail);
+  }
+
+  std::cout << "After maintenance:" << std::endl;
+  report_size(imp.get());
+}
+
+// Transactions nest; only the outermost pair reaches sqlite
 void Database::begin_txn() {
-  single_step("Could not begin a transaction", imp->begin_txn, imp->debugdb);
+  if (imp->txn_depth++ == 0)
+    single_step("Could not begin a transaction", imp->begin_txn, imp->debugdb);
 }
 
 void Database::end_txn() {
-  single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
+  if (--imp->txn_depth == 0)
+    single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
+}
+
+// Insert a null separated list of paths, TREE_BATCH rows per step
+static void insert_tree(Database::detail *imp, const char *why, int access, long job, const std::string &paths, std::vector<long> *ids = 0) {
+  long row[TREE_BATCH];
+  int rows = 0;
+  const char *tok = paths.c_str();
+  const char *end = tok + paths.size();
+  for (const char *scan = tok; scan != end; ++scan) {
+    if (*scan == 0 && scan != tok) {
+      row[rows] = find_file_id(imp, why, std::string(tok, scan-tok));
+      if (ids) ids->push_back(row[rows]);
+      if (++rows == TREE_BATCH) {
+        bind_integer(why, imp->insert_trees, 1, access);
+        bind_integer(why, imp->insert_trees, 2, job);
+        for (int i = 0; i < rows; ++i)
+          bind_integer(why, imp->insert_trees, i+3, row[i]);
+        single_step (why, imp->insert_trees, imp->debugdb);
+        rows = 0;
+      }
+      tok = scan+1;
+    }
+  }
+  for (int i = 0; i < rows; ++i) {
+    bind_integer(why, imp->insert_tree, 1, access);
+    bind_integer(why, imp->insert_tree, 2, job);
+    bind_integer(why, imp->insert_tree, 3, row[i]);
+    single_step (why, imp->insert_tree, imp->debugdb);
+  }
+}
+
+// Slow (eg: NFS) metadata lookups dominate, so large output sets are checked concurrently
+void CheckPool::scan(const std::vector<FileReflection> &list) {
+  size_t i;
+  while (!missing && (i = next++) < list.size())
+    if (access(list[i].path.c_str(), R_OK) != 0) missing = true;
+}
+
+void CheckPool::work() {
+  unsigned long seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [&]() { return stop || round != seen; });
+    if (stop) return;
+    seen = round;
+    const std::vector<FileReflection> &list = *files;
+    lock.unlock();
+    scan(list);
+    lock.lock();
+    if (--busy == 0) done.notify_one();
+  }
+}
+
+bool CheckPool::all_readable(const std::vector<FileReflection> &list) {
+  if (list.size() <= CHECK_BATCH) {
+    for (auto &f : list)
+      if (access(f.path.c_str(), R_OK) != 0) return false;
+    return true;
+  }
+
+  if (threads.empty()) {
+    // Workers must never take the signals the JobTable waits for in pselect
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    for (int t = 1; t < CHECK_THREADS; ++t)
+      threads.emplace_back(&CheckPool::work, this);
+    pthread_sigmask(SIG_SETMASK, &saved, 0);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    files = &list;
+    next = 0;
+    missing = false;
+    busy = threads.size();
+    ++round;
+  }
+  wake.notify_all();
+  scan(list);
+
+  std::unique_lock<std::mutex> lock(mutex);
+  done.wait(lock, [&]() { return busy == 0; });
+  files = 0;
+  return !missing;
+}
+
+CheckPool::~CheckPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+  }
+  wake.notify_all();
+  for (auto &t : threads) t.join();
+}
+
+// The blob_id holding content; -1 if there is none and !create
+static long intern_blob(Database::detail *imp, const char *why, const std::string &content, bool create) {
+  Hash hash(content);
+  long hashcode = hash.data[0];
+
+  long blob_id = -1;
+  bind_integer(why, imp->find_blob, 1, hashcode);
+  while (blob_id == -1 && step(imp->find_blob) == SQLITE_ROW)
+    if (rip_column(imp->find_blob, 1) == content)
+      blob_id = sqlite3_column_int64(imp->find_blob, 0);
+  finish_stmt(why, imp->find_blob, imp->debugdb);
+
+  if (blob_id == -1 && create) {
+    bind_integer(why, imp->add_blob, 1, hashcode);
+    bind_blob   (why, imp->add_blob, 2, content);
+    single_step (why, imp->add_blob, imp->debugdb);
+    blob_id = sqlite3_last_insert_rowid(imp->db);
+  }
+  return blob_id;
 }
 
 // This function needs to be able to run twice in succession and return the same results
@@ -565,9 +1385,9 @@ Usage Database::reuse_job(
   begin_txn();
   bind_string (why, imp->find_prior, 1, directory);
   bind_blob   (why, imp->find_prior, 2, commandline);
-  bind_blob   (why, imp->find_prior, 3, environment);
+  bind_integer(why, imp->find_prior, 3, intern_blob(imp.get(), why, environment, false));
   bind_string (why, imp->find_prior, 4, stdin);
-  out.found = sqlite3_step(imp->find_prior) == SQLITE_ROW;
+  out.found = step(imp->find_prior) == SQLITE_ROW;
   if (out.found) {
     job     = sqlite3_column_int64(imp->find_prior, 0);
     stat_id = sqlite3_column_int64(imp->find_prior, 1);
@@ -580,7 +1400,7 @@ Usage Database::reuse_job(
   }
 
   bind_integer(why, imp->stats_job, 1, stat_id);
-  if (sqlite3_step(imp->stats_job) == SQLITE_ROW) {
+  if (step(imp->stats_job) == SQLITE_ROW) {
     out.status   = sqlite3_column_int64 (imp->stats_job, 0);
     out.runtime  = sqlite3_column_double(imp->stats_job, 1);
     out.cputime  = sqlite3_column_double(imp->stats_job, 2);
@@ -593,16 +1413,24 @@ Usage Database::reuse_job(
   }
   finish_stmt(why, imp->stats_job, imp->debugdb);
 
+  std::vector<long> ids;
   bind_integer(why, imp->get_tree, 1, job);
   bind_integer(why, imp->get_tree, 2, OUTPUT);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
-    std::string path = rip_column(imp->get_tree, 0);
-    if (access(path.c_str(), R_OK) != 0) out.found = false;
-    files.emplace_back(std::move(path), rip_column(imp->get_tree, 1));
+  while (step(imp->get_tree) == SQLITE_ROW) {
+    files.emplace_back(rip_path(imp.get(), why, imp->get_tree, 0), rip_column(imp->get_tree, 2));
+    ids.push_back(sqlite3_column_int64(imp->get_tree, 3));
   }
   finish_stmt(why, imp->get_tree, imp->debugdb);
+  end_txn();
+
+  // A job whose outputs were already produced by another job of this run is superseded
+  for (long id : ids) {
+    auto it = imp->owners.find(id);
+    if (it != imp->owners.end() && it->second != job) out.found = false;
+  }
 
   // If we need to rerun the job (outputs don't exist), wipe the files-to-check list
+  if (out.found && !imp->checker.all_readable(files)) out.found = false;
   if (!out.found) {
     files.clear();
   }
@@ -611,19 +1439,47 @@ Usage Database::reuse_job(
     bind_integer(why, imp->update_prior, 1, imp->run_id);
     bind_integer(why, imp->update_prior, 2, job);
     single_step (why, imp->update_prior, imp->debugdb);
+    for (long id : ids) imp->owners[id] = job;
   }
 
-  end_txn();
+  return out;
+}
 
+static std::string encode_profile(const Profile &profile) {
+  std::string out;
+  out.reserve(8 * profile.membytes.size());
+  for (size_t i = 0; i < profile.membytes.size(); ++i) {
+    uint32_t sample[2];
+    sample[0] = std::min(profile.membytes[i] >> 10, (uint64_t)UINT32_MAX);
+    sample[1] = profile.cpus[i] * 100 + 0.5;
+    for (uint32_t x : sample)
+      for (int b = 0; b < 32; b += 8)
+        out.push_back((x >> b) & 0xff);
+  }
   return out;
 }
 
-Usage Database::predict_job(uint64_t hashcode, double *pathtime)
+static void decode_profile(sqlite3_stmt *stmt, int column, Profile *profile) {
+  const unsigned char *data = static_cast<const unsigned char*>(sqlite3_column_blob(stmt, column+1));
+  int bytes = sqlite3_column_bytes(stmt, column+1);
+  profile->interval = sqlite3_column_double(stmt, column);
+  profile->membytes.clear();
+  profile->cpus.clear();
+  for (int i = 0; i+8 <= bytes; i += 8) {
+    uint32_t sample[2];
+    for (int j = 0; j < 2; ++j)
+      sample[j] = data[i+4*j] | (data[i+4*j+1] << 8) | (data[i+4*j+2] << 16) | ((uint32_t)data[i+4*j+3] << 24);
+    profile->membytes.push_back((uint64_t)sample[0] << 10);
+    profile->cpus.push_back(sample[1] / 100.0);
+  }
+}
+
+Usage Database::predict_job(uint64_t hashcode, double *pathtime, Profile *profile)
 {
   Usage out;
   const char *why = "Could not predict a job";
   bind_integer(why, imp->predict_job, 1, hashcode);
-  if (sqlite3_step(imp->predict_job) == SQLITE_ROW) {
+  if (step(imp->predict_job) == SQLITE_ROW) {
     out.found    = true;
     out.status   = sqlite3_column_int   (imp->predict_job, 0);
     out.runtime  = sqlite3_column_double(imp->predict_job, 1);
@@ -632,6 +1488,7 @@ Usage Database::predict_job(uint64_t hashcode, double *pathtime)
     out.ibytes   = sqlite3_column_int64 (imp->predict_job, 4);
     out.obytes   = sqlite3_column_int64 (imp->predict_job, 5);
     *pathtime    = sqlite3_column_double(imp->predict_job, 6);
+    if (profile) decode_profile(imp->predict_job, 7, profile);
   } else {
     out.found    = false;
     out.status   = 0;
@@ -646,6 +1503,183 @@ Usage Database::predict_job(uint64_t hashcode, double *pathtime)
   return out;
 }
 
+// Visible sets are stored once, as sorted file_ids encoded as LEB128 gaps
+static std::string encode_visible(std::vector<long> &ids) {
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+  std::string out;
+  long last = 0;
+  for (long id : ids) {
+    uint64_t gap = id - last;
+    last = id;
+    do {
+      out.push_back((gap & 0x7f) | (gap > 0x7f ? 0x80 : 0));
+      gap >>= 7;
+    } while (gap);
+  }
+  return out;
+}
+
+static std::vector<long> decode_visible(sqlite3_stmt *stmt, int column) {
+  const unsigned char *data = static_cast<const unsigned char*>(sqlite3_column_blob(stmt, column));
+  int bytes = sqlite3_column_bytes(stmt, column);
+  std::vector<long> out;
+  long last = 0;
+  uint64_t gap = 0;
+  int shift = 0;
+  for (int i = 0; i < bytes; ++i) {
+    gap |= (uint64_t)(data[i] & 0x7f) << shift;
+    shift += 7;
+    if (!(data[i] & 0x80)) {
+      last += gap;
+      out.push_back(last);
+      gap = 0;
+      shift = 0;
+    }
+  }
+  return out;
+}
+
+static void insert_visible(Database::detail *imp, const char *why, long job, std::vector<long> &ids) {
+  std::string files = encode_visible(ids);
+  Hash hash(files);
+  long hashcode = hash.data[0];
+
+  long set_id = -1;
+  bind_integer(why, imp->find_visible, 1, hashcode);
+  while (set_id == -1 && step(imp->find_visible) == SQLITE_ROW)
+    if (rip_column(imp->find_visible, 1) == files)
+      set_id = sqlite3_column_int64(imp->find_visible, 0);
+  finish_stmt(why, imp->find_visible, imp->debugdb);
+
+  if (set_id == -1) {
+    bind_integer(why, imp->add_visible, 1, hashcode);
+    bind_blob   (why, imp->add_visible, 2, files);
+    single_step (why, imp->add_visible, imp->debugdb);
+    set_id = sqlite3_last_insert_rowid(imp->db);
+  }
+
+  bind_integer(why, imp->link_visible, 1, job);
+  bind_integer(why, imp->link_visible, 2, set_id);
+  single_step (why, imp->link_visible, imp->debugdb);
+}
+
+static void insert_visible(Database::detail *imp, const char *why, long job, const std::string &paths) {
+  std::vector<long> ids;
+  const char *tok = paths.c_str();
+  const char *end = tok + paths.size();
+  for (const char *scan = tok; scan != end; ++scan) {
+    if (*scan == 0 && scan != tok) {
+      ids.push_back(find_file_id(imp, why, std::string(tok, scan-tok)));
+      tok = scan+1;
+    }
+  }
+  insert_visible(imp, why, job, ids);
+}
+
+static void migrate_sql(Database::detail *imp, const char *why, const char *sql) {
+  char *fail;
+  if (sqlite3_exec(imp->db, sql, 0, 0, &fail) != SQLITE_OK) {
+    std::cerr << why << ": " << fail << std::endl;
+    exit(1);
+  }
+}
+
+// Each step upgrades wake.db from the version before it; all of them commit together.
+// Tables set aside are refilled in turn, so foreign keys are only checked at commit.
+static void migrate(Database::detail *imp, long version) {
+  const char *why = "Could not migrate wake.db";
+  migrate_sql(imp, why, "begin transaction");
+  migrate_sql(imp, why, "pragma defer_foreign_keys=on");
+
+  // Before version 1, stats.membytes held ru_maxrss in KiB
+  if (version < 1) migrate_sql(imp, why, "update stats set membytes=membytes*1024");
+
+  // Before version 2, files held whole paths and filetree held visible files (access=0)
+  if (version < 2 && has_table(imp->db, "files_v1")) {
+    sqlite3_stmt *old = prepare_once(imp, why, "select file_id, path, hash, modified from files_v1");
+    sqlite3_stmt *add = prepare_once(imp, why, "insert into files(file_id, dir_id, name, hash, modified) values(?, ?, ?, ?, ?)");
+    while (step(old) == SQLITE_ROW) {
+      std::string path = rip_column(old, 1);
+      std::string hash = rip_column(old, 2);
+      bind_integer(why, add, 1, sqlite3_column_int64(old, 0));
+      bind_path   (imp, why, add, 2, path, true);
+      bind_string (why, add, 4, hash);
+      bind_integer(why, add, 5, sqlite3_column_int64(old, 3));
+      single_step (why, add, imp->debugdb);
+    }
+    finish_stmt(why, old, imp->debugdb);
+    sqlite3_finalize(old);
+    sqlite3_finalize(add);
+    migrate_sql(imp, why, "drop table files_v1");
+  }
+  if (version < 2) {
+    sqlite3_stmt *old = prepare_once(imp, why,
+      "select job_id, file_id from filetree where access=0"
+      " and job_id not in (select job_id from jobvisible) order by job_id");
+    std::vector<long> ids;
+    long job = -1;
+    while (true) {
+      bool row = step(old) == SQLITE_ROW;
+      long next = row ? sqlite3_column_int64(old, 0) : -1;
+      if (next != job && !ids.empty()) {
+        insert_visible(imp, why, job, ids);
+        ids.clear();
+      }
+      if (!row) break;
+      job = next;
+      ids.push_back(sqlite3_column_int64(old, 1));
+    }
+    finish_stmt(why, old, imp->debugdb);
+    sqlite3_finalize(old);
+    migrate_sql(imp, why, "delete from filetree where access=0");
+  }
+
+  // Before version 3, every job held its own copy of its environment and stack
+  if (version < 3 && has_table(imp->db, "jobs_v2")) {
+    sqlite3_stmt *old = prepare_once(imp, why,
+      "select job_id, run_id, use_id, directory, commandline, environment, stack, stdin, stat_id, endtime, keep from jobs_v2");
+    sqlite3_stmt *add = prepare_once(imp, why,
+      "insert into jobs(job_id, run_id, use_id, directory, commandline, env_id, stack_id, stdin, stat_id, endtime, keep)"
+      " values(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
+    while (step(old) == SQLITE_ROW) {
+      for (int i = 0; i < 11; ++i) {
+        if (i == 5 || i == 6) {
+          bind_integer(why, add, i+1, intern_blob(imp, why, rip_column(old, i), true));
+        } else if (sqlite3_bind_value(add, i+1, sqlite3_column_value(old, i)) != SQLITE_OK) {
+          std::cerr << why << "; sqlite3_bind_value(" << i+1 << "): " << sqlite3_errmsg(imp->db) << std::endl;
+          exit(1);
+        }
+      }
+      single_step(why, add, imp->debugdb);
+    }
+    finish_stmt(why, old, imp->debugdb);
+    sqlite3_finalize(old);
+    sqlite3_finalize(add);
+    migrate_sql(imp, why, "drop table jobs_v2");
+  }
+
+  migrate_sql(imp, why, "pragma user_version=" TOSTRING(SCHEMA_VERSION));
+  migrate_sql(imp, why, "commit transaction");
+}
+
+static void get_visible(Database::detail *imp, const char *why, long job, std::vector<FileReflection> &out) {
+  std::vector<long> ids;
+  bind_integer(why, imp->get_visible, 1, job);
+  if (step(imp->get_visible) == SQLITE_ROW) ids = decode_visible(imp->get_visible, 0);
+  finish_stmt(why, imp->get_visible, imp->debugdb);
+
+  for (long id : ids) {
+    bind_integer(why, imp->get_file, 1, id);
+    if (step(imp->get_file) == SQLITE_ROW)
+      out.emplace_back(rip_path(imp, why, imp->get_file, 0), rip_column(imp->get_file, 2));
+    finish_stmt(why, imp->get_file, imp->debugdb);
+  }
+
+  std::sort(out.begin(), out.end(), [](const FileReflection &a, const FileReflection &b) { return a.path < b.path; });
+}
+
 void Database::insert_job(
   const std::string &directory,
   const std::string &stdin,
@@ -660,26 +1694,27 @@ void Database::insert_job(
   bind_integer(why, imp->insert_job, 1, imp->run_id);
   bind_string (why, imp->insert_job, 2, directory);
   bind_blob   (why, imp->insert_job, 3, commandline);
-  bind_blob   (why, imp->insert_job, 4, environment);
-  bind_blob   (why, imp->insert_job, 5, stack);
+  bind_integer(why, imp->insert_job, 4, intern_blob(imp.get(), why, environment, true));
+  bind_integer(why, imp->insert_job, 5, intern_blob(imp.get(), why, stack, true));
   bind_string (why, imp->insert_job, 6, stdin);
   single_step (why, imp->insert_job, imp->debugdb);
   *job = sqlite3_last_insert_rowid(imp->db);
-  const char *tok = visible.c_str();
-  const char *end = tok + visible.size();
-  for (const char *scan = tok; scan != end; ++scan) {
-    if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, VISIBLE);
-      bind_integer(why, imp->insert_tree, 2, *job);
-      bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-      single_step (why, imp->insert_tree, imp->debugdb);
-      tok = scan+1;
-    }
-  }
+  insert_visible(imp.get(), why, *job, visible);
   end_txn();
 }
 
-void Database::finish_job(long job, const std::string &inputs, const std::string &outputs, uint64_t hashcode, bool keep, Usage reality) {
+void Database::record_limit(double cpu, double memory, double io, double old, double limit) {
+  const char *why = "Could not record job limit";
+  bind_integer(why, imp->add_limit, 1, imp->run_id);
+  bind_double (why, imp->add_limit, 2, cpu);
+  bind_double (why, imp->add_limit, 3, memory);
+  bind_double (why, imp->add_limit, 4, io);
+  bind_double (why, imp->add_limit, 5, old);
+  bind_double (why, imp->add_limit, 6, limit);
+  single_step (why, imp->add_limit, imp->debugdb);
+}
+
+void Database::finish_job(long job, const std::string &inputs, const std::string &outputs, uint64_t hashcode, bool keep, Usage reality, const Profile &profile) {
   const char *why = "Could not save job inputs and outputs";
   begin_txn();
   bind_integer(why, imp->add_stats, 1, hashcode);
@@ -690,64 +1725,65 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
   bind_integer(why, imp->add_stats, 6, reality.ibytes);
   bind_integer(why, imp->add_stats, 7, reality.obytes);
   single_step (why, imp->add_stats, imp->debugdb);
-  bind_integer(why, imp->link_stats, 1, sqlite3_last_insert_rowid(imp->db));
+  long stat_id = sqlite3_last_insert_rowid(imp->db);
+  if (!profile.membytes.empty()) {
+    std::string samples = encode_profile(profile);
+    bind_integer(why, imp->add_profile, 1, stat_id);
+    bind_double (why, imp->add_profile, 2, profile.interval);
+    bind_blob   (why, imp->add_profile, 3, samples);
+    single_step (why, imp->add_profile, imp->debugdb);
+  }
+  bind_integer(why, imp->link_stats, 1, stat_id);
   bind_integer(why, imp->link_stats, 2, keep?1:0);
   bind_integer(why, imp->link_stats, 3, job);
   single_step (why, imp->link_stats, imp->debugdb);
-  const char *tok = inputs.c_str();
-  const char *end = tok + inputs.size();
-  for (const char *scan = tok; scan != end; ++scan) {
-    if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, INPUT);
-      bind_integer(why, imp->insert_tree, 2, job);
-      bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-      single_step (why, imp->insert_tree, imp->debugdb);
-      tok = scan+1;
-    }
-  }
-  tok = outputs.c_str();
-  end = tok + outputs.size();
-  for (const char *scan = tok; scan != end; ++scan) {
-    if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, OUTPUT);
-      bind_integer(why, imp->insert_tree, 2, job);
-      bind_string (why, imp->insert_tree, 3, tok, scan-tok);
-      single_step (why, imp->insert_tree, imp->debugdb);
-      tok = scan+1;
-    }
-  }
+  insert_tree(imp.get(), why, INPUT,  job, inputs);
+  std::vector<long> ids;
+  insert_tree(imp.get(), why, OUTPUT, job, outputs, &ids);
 
   bind_integer(why, imp->delete_prior, 1, imp->run_id);
   bind_integer(why, imp->delete_prior, 2, job);
   single_step (why, imp->delete_prior, imp->debugdb);
 
-  bind_integer(why, imp->delete_overlap, 1, imp->run_id);
-  bind_integer(why, imp->delete_overlap, 2, job);
-  single_step (why, imp->delete_overlap, imp->debugdb);
-
+  // Jobs of older runs which wrote these outputs are superseded
   bool fail = false;
-  bind_integer(why, imp->detect_overlap, 1, job);
-  while (sqlite3_step(imp->detect_overlap) == SQLITE_ROW) {
-    std::stringstream s;
-    s << "File output by multiple Jobs: " << rip_column(imp->detect_overlap, 0) << std::endl;
-    std::string out = s.str();
-    status_write(2, out.data(), out.size());
-    fail = true;
+  for (long id : ids) {
+    bind_integer(why, imp->delete_overlap, 1, imp->run_id);
+    bind_integer(why, imp->delete_overlap, 2, id);
+    single_step (why, imp->delete_overlap, imp->debugdb);
+
+    long &owner = imp->owners[id];
+    if (owner && owner != job) {
+      std::string path;
+      bind_integer(why, imp->get_file, 1, id);
+      if (step(imp->get_file) == SQLITE_ROW) path = rip_path(imp.get(), why, imp->get_file, 0);
+      finish_stmt(why, imp->get_file, imp->debugdb);
+      std::stringstream s;
+      s << "File output by multiple Jobs: " << path << std::endl;
+      std::string out = s.str();
+      status_write(2, out.data(), out.size());
+      fail = true;
+    }
+    owner = job;
   }
-  finish_stmt(why, imp->detect_overlap, imp->debugdb);
 
   end_txn();
 
+  // The jobs which finished earlier in a batch are committed at exit
   if (fail) exit(1);
 }
 
 std::vector<FileReflection> Database::get_tree(int kind, long job)  {
   std::vector<FileReflection> out;
   const char *why = "Could not read job tree";
+  if (kind == VISIBLE) {
+    get_visible(imp.get(), why, job, out);
+    return out;
+  }
   bind_integer(why, imp->get_tree, 1, job);
   bind_integer(why, imp->get_tree, 2, kind);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
-    out.emplace_back(rip_column(imp->get_tree, 0), rip_column(imp->get_tree, 1));
+  while (step(imp->get_tree) == SQLITE_ROW)
+    out.emplace_back(rip_path(imp.get(), why, imp->get_tree, 0), rip_column(imp->get_tree, 2));
   finish_stmt(why, imp->get_tree, imp->debugdb);
   return out;
 }
@@ -761,33 +1797,62 @@ void Database::save_output(long job, int descriptor, const char *buffer, int siz
   single_step (why, imp->insert_log, imp->debugdb);
 }
 
+void Database::index_output(long job, int descriptor, long offset, double runtime) {
+  const char *why = "Could not index job output";
+  bind_integer(why, imp->index_log, 1, job);
+  bind_integer(why, imp->index_log, 2, descriptor);
+  bind_double (why, imp->index_log, 3, runtime);
+  bind_integer(why, imp->index_log, 4, offset);
+  single_step (why, imp->index_log, imp->debugdb);
+}
+
+std::string Database::output_file(long job, int descriptor) {
+  return OUTPUT_DIR "/" + std::to_string(job) + (descriptor == 1 ? ".stdout" : ".stderr");
+}
+
 std::string Database::get_output(long job, int descriptor) {
   std::stringstream out;
   const char *why = "Could not read job output";
   bind_integer(why, imp->get_log, 1, job);
   bind_integer(why, imp->get_log, 2, descriptor);
-  while (sqlite3_step(imp->get_log) == SQLITE_ROW) {
+  while (step(imp->get_log) == SQLITE_ROW) {
     out.write(
       static_cast<const char*>(sqlite3_column_blob(imp->get_log, 0)),
       sqlite3_column_bytes(imp->get_log, 0));
   }
   finish_stmt(why, imp->get_log, imp->debugdb);
+
+  // Output captured to a file is only valid up to the last indexed offset
+  long size = -1;
+  bind_integer(why, imp->get_log_size, 1, job);
+  bind_integer(why, imp->get_log_size, 2, descriptor);
+  if (step(imp->get_log_size) == SQLITE_ROW && sqlite3_column_type(imp->get_log_size, 0) != SQLITE_NULL)
+    size = sqlite3_column_int64(imp->get_log_size, 0);
+  finish_stmt(why, imp->get_log_size, imp->debugdb);
+
+  if (size > 0) {
+    std::ifstream file(output_file(job, descriptor), std::ios::binary);
+    std::vector<char> buf(size);
+    file.read(buf.data(), size);
+    out.write(buf.data(), file.gcount());
+  }
+
   return out.str();
 }
 
 void Database::add_hash(const std::string &file, const std::string &hash, long modified) {
   const char *why = "Could not insert a hash";
   begin_txn();
-  bind_string (why, imp->wipe_file, 1, file);
-  bind_string (why, imp->wipe_file, 2, hash);
+  bind_path   (imp.get(), why, imp->wipe_file, 1, file);
+  bind_string (why, imp->wipe_file, 3, hash);
   single_step (why, imp->wipe_file, imp->debugdb);
   bind_string (why, imp->update_file, 1, hash);
   bind_integer(why, imp->update_file, 2, modified);
-  bind_string (why, imp->update_file, 3, file);
+  bind_path   (imp.get(), why, imp->update_file, 3, file);
   single_step (why, imp->update_file, imp->debugdb);
   bind_string (why, imp->insert_file, 1, hash);
   bind_integer(why, imp->insert_file, 2, modified);
-  bind_string (why, imp->insert_file, 3, file);
+  bind_path   (imp.get(), why, imp->insert_file, 3, file, true);
   single_step (why, imp->insert_file, imp->debugdb);
   end_txn();
 }
@@ -795,9 +1860,9 @@ void Database::add_hash(const std::string &file, const std::string &hash, long m
 std::string Database::get_hash(const std::string &file, long modified) {
   std::string out;
   const char *why = "Could not fetch a hash";
-  bind_string (why, imp->fetch_hash, 1, file);
-  bind_integer(why, imp->fetch_hash, 2, modified);
-  if (sqlite3_step(imp->fetch_hash) == SQLITE_ROW)
+  bind_path   (imp.get(), why, imp->fetch_hash, 1, file);
+  bind_integer(why, imp->fetch_hash, 3, modified);
+  if (step(imp->fetch_hash) == SQLITE_ROW)
     out = rip_column(imp->fetch_hash, 0);
   finish_stmt(why, imp->fetch_hash, imp->debugdb);
   return out;
@@ -816,16 +1881,15 @@ static std::vector<std::string> chop_null(const std::string &str) {
   return out;
 }
 
-std::vector<JobReflection> Database::explain(const std::string &file, int use, bool verbose) {
+void Database::explain(const std::string &file, int use, bool verbose, const std::function<void(const JobReflection &)> &emit) {
   const char *why = "Could not explain file";
-  std::vector<JobReflection> out;
 
   begin_txn();
-  bind_string (why, imp->find_owner, 1, file);
-  bind_integer(why, imp->find_owner, 2, use);
-  while (sqlite3_step(imp->find_owner) == SQLITE_ROW) {
-    out.resize(out.size()+1);
-    JobReflection &desc = out.back();
+  bind_path   (imp.get(), why, imp->find_owner, 1, file);
+  bind_integer(why, imp->find_owner, 3, use);
+  while (step(imp->find_owner) == SQLITE_ROW) {
+    // Only one job (and its file lists) is held in memory at a time
+    JobReflection desc;
     desc.job            = sqlite3_column_int64(imp->find_owner, 0);
     desc.directory      = rip_column(imp->find_owner, 1);
     desc.commandline    = chop_null(rip_column(imp->find_owner, 2));
@@ -843,34 +1907,80 @@ std::vector<JobReflection> Database::explain(const std::string &file, int use, b
     if (verbose) {
       desc.stdout = get_output(desc.job, 1);
       desc.stderr = get_output(desc.job, 2);
-      // visible
-      bind_integer(why, imp->get_tree, 1, desc.job);
-      bind_integer(why, imp->get_tree, 2, VISIBLE);
-      while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
-        desc.visible.emplace_back(
-          rip_column(imp->get_tree, 0),
-          rip_column(imp->get_tree, 1));
-      finish_stmt(why, imp->get_tree, imp->debugdb);
+      get_visible(imp.get(), why, desc.job, desc.visible);
     }
     // inputs
     bind_integer(why, imp->get_tree, 1, desc.job);
     bind_integer(why, imp->get_tree, 2, INPUT);
-    while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
+    while (step(imp->get_tree) == SQLITE_ROW)
       desc.inputs.emplace_back(
-        rip_column(imp->get_tree, 0),
-        rip_column(imp->get_tree, 1));
+        rip_path(imp.get(), why, imp->get_tree, 0),
+        rip_column(imp->get_tree, 2));
     finish_stmt(why, imp->get_tree, imp->debugdb);
     // outputs
     bind_integer(why, imp->get_tree, 1, desc.job);
     bind_integer(why, imp->get_tree, 2, OUTPUT);
-    while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
+    while (step(imp->get_tree) == SQLITE_ROW)
       desc.outputs.emplace_back(
-        rip_column(imp->get_tree, 0),
-        rip_column(imp->get_tree, 1));
+        rip_path(imp.get(), why, imp->get_tree, 0),
+        rip_column(imp->get_tree, 2));
     finish_stmt(why, imp->get_tree, imp->debugdb);
+    emit(desc);
   }
   finish_stmt(why, imp->find_owner, imp->debugdb);
   end_txn();
+}
+
+std::vector<ImpactReflection> Database::impact(const std::vector<std::string> &files) {
+  const char *why = "Could not compute impact";
+  std::vector<ImpactReflection> out;
+  std::unordered_set<long> seen_files, seen_jobs;
+  std::vector<long> frontier, next;
+
+  begin_txn();
+  for (auto &file : files) {
+    bind_path(imp.get(), why, imp->find_file, 1, file);
+    if (step(imp->find_file) == SQLITE_ROW) {
+      long id = sqlite3_column_int64(imp->find_file, 0);
+      if (seen_files.insert(id).second) frontier.push_back(id);
+    }
+    finish_stmt(why, imp->find_file, imp->debugdb);
+  }
+
+  // Breadth-first: jobs reading the frontier rerun, and their outputs join the next frontier
+  for (int depth = 0; !frontier.empty(); ++depth) {
+    next.clear();
+    for (long file : frontier) {
+      bind_integer(why, imp->file_readers, 1, file);
+      while (step(imp->file_readers) == SQLITE_ROW) {
+        long job = sqlite3_column_int64(imp->file_readers, 0);
+        if (!seen_jobs.insert(job).second) continue;
+        out.resize(out.size()+1);
+        out.back().job = job;
+        out.back().depth = depth;
+      }
+      finish_stmt(why, imp->file_readers, imp->debugdb);
+    }
+    for (size_t i = out.size(); i > 0 && out[i-1].depth == depth; --i) {
+      bind_integer(why, imp->job_outputs, 1, out[i-1].job);
+      while (step(imp->job_outputs) == SQLITE_ROW) {
+        long id = sqlite3_column_int64(imp->job_outputs, 0);
+        if (seen_files.insert(id).second) next.push_back(id);
+      }
+      finish_stmt(why, imp->job_outputs, imp->debugdb);
+    }
+    frontier.swap(next);
+  }
+
+  for (auto &x : out) {
+    bind_integer(why, imp->job_summary, 1, x.job);
+    if (step(imp->job_summary) == SQLITE_ROW) {
+      x.commandline = chop_null(rip_column(imp->job_summary, 0));
+      x.runtime = sqlite3_column_double(imp->job_summary, 1);
+    }
+    finish_stmt(why, imp->job_summary, imp->debugdb);
+  }
+  end_txn();
 
   return out;
 }
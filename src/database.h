@@ -19,6 +19,7 @@
 #define DATABASE_H
 
 #include <memory>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -28,9 +29,18 @@ struct FileReflection {
   FileReflection(std::string &&path_, std::string &&hash_) : path(std::move(path_)), hash(std::move(hash_)) { }
 };
 
+struct FileStamp {
+  std::string path;
+  long modified;
+  FileStamp(std::string &&path_, long modified_) : path(std::move(path_)), modified(modified_) { }
+};
+
+// Usage.status of a job killed by its timeout; beyond the range of any exit code or signal
+#define STATUS_TIMEOUT (-256)
+
 struct Usage {
   bool found;
-  int status; // -signal, +code
+  int status; // -signal, +code, or STATUS_TIMEOUT
   double runtime;
   double cputime;
   uint64_t membytes;
@@ -40,6 +50,18 @@ struct Usage {
   Usage() : found(false) { }
 };
 
+// Directory holding job output captured with --log-files
+#define OUTPUT_DIR ".build/logs"
+
+// Resource use of a job, sampled every interval seconds while it ran
+struct Profile {
+  double interval;
+  std::vector<uint64_t> membytes; // resident memory of all the job's processes
+  std::vector<double> cpus;       // cores busy since the previous sample
+
+  Profile() : interval(0) { }
+};
+
 struct JobReflection {
   long job;
   std::string directory;
@@ -56,14 +78,22 @@ struct JobReflection {
   std::vector<FileReflection> outputs;
 };
 
+struct ImpactReflection {
+  long job;
+  int depth; // 0 = reads a changed file directly
+  double runtime; // of its last run
+  std::vector<std::string> commandline;
+};
+
 struct Database {
   struct detail;
   std::unique_ptr<detail> imp;
 
-  Database(bool debugdb);
+  Database(bool debugdb, bool profiledb = false);
   ~Database();
 
-  std::string open(bool wait, bool memory);
+  // readonly runs beside a build whose writer opened with shared
+  std::string open(bool wait, bool memory, bool readonly = false, bool shared = false);
   void close();
 
   void entropy(uint64_t *key, int words);
@@ -72,8 +102,12 @@ struct Database {
   void add_target(const std::string &target);
   void del_target(const std::string &target);
 
+  // Inputs of every job used by the previous run; returns its critical path length
+  double lookahead(std::vector<std::vector<FileStamp> > &inputs); // call before prepare
   void prepare(); // prepare for job execution
   void clean(); // finished execution; sweep stale jobs
+  // Report usage, expire unkept jobs older than runs/days (0=any), vacuum for up to budget seconds
+  void maintain(int runs, double days, double budget);
 
   void begin_txn();
   void end_txn();
@@ -90,7 +124,8 @@ struct Database {
     double *pathtime);
   Usage predict_job(
     uint64_t hashcode,
-    double *pathtime);
+    double *pathtime,
+    Profile *profile = 0); // filled if the last run was sampled
   void insert_job( // also wipes out any old runs
     const std::string &directory,
     const std::string &stdin, // "" -> /dev/null
@@ -106,8 +141,11 @@ struct Database {
     const std::string &outputs, // null separated
     uint64_t hashcode,
     bool keep,
-    Usage reality);
+    Usage reality,
+    const Profile &profile);
   std::vector<FileReflection> get_tree(int kind, long job);
+  // The job limit moved from old to limit CPUs under the given stall percentages
+  void record_limit(double cpu, double memory, double io, double old, double limit);
 
   void save_output( // call only if needs_build -> true
     long job,
@@ -115,9 +153,15 @@ struct Database {
     const char *buffer,
     int size,
     double runtime);
+  void index_output( // output already captured into output_file
+    long job,
+    int descriptor,
+    long offset,
+    double runtime);
   std::string get_output(
     long job,
     int descriptor);
+  static std::string output_file(long job, int descriptor);
 
   void add_hash(
     const std::string &file,
@@ -128,10 +172,14 @@ struct Database {
     const std::string &file,
     long modified);
 
-  std::vector<JobReflection> explain(
+  void explain( // calls emit for each matching job as it is read
     const std::string &file,
     int use,
-    bool verbose);
+    bool verbose,
+    const std::function<void(const JobReflection &)> &emit);
+
+  // Jobs which would rerun if files changed, following outputs into their readers
+  std::vector<ImpactReflection> impact(const std::vector<std::string> &files);
 };
 
 #endif
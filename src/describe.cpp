@@ -19,6 +19,7 @@
 #include "database.h"
 #include "shell.h"
 #include "execpath.h"
+#include "json5.h"
 #include <iostream>
 #include <string>
 
@@ -34,116 +35,186 @@ static void indent(const std::string& tab, const std::string& body) {
   std::cout << std::endl;
 }
 
-static void describe_human(const std::vector<JobReflection> &jobs, bool debug, bool verbose) {
-  for (auto &job : jobs) {
-    std::cout
-      << "Job " << job.job << ":" << std::endl
-      << "  Command-line:";
-    for (auto &arg : job.commandline) std::cout << " " << shell_escape(arg);
-    std::cout
-      << std::endl
-      << "  Environment:" << std::endl;
-    for (auto &env : job.environment)
-      std::cout << "    " << shell_escape(env) << std::endl;
-    std::cout
-      << "  Directory: " << job.directory << std::endl
-      << "  Built:     " << job.time << std::endl
-      << "  Runtime:   " << job.usage.runtime << std::endl
-      << "  CPUtime:   " << job.usage.cputime << std::endl
-      << "  Mem bytes: " << job.usage.membytes << std::endl
-      << "  In  bytes: " << job.usage.ibytes << std::endl
-      << "  Out bytes: " << job.usage.obytes << std::endl
-      << "  Status:    " << job.usage.status << std::endl
-      << "  Stdin:     " << job.stdin << std::endl;
-    if (verbose) {
-      std::cout << "Visible:" << std::endl;
-      for (auto &in : job.visible)
-        std::cout << "  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
-                  << " " << in.path << std::endl;
-    }
-    std::cout << "Inputs:" << std::endl;
-    for (auto &in : job.inputs)
+static void describe_human(const JobReflection &job, bool debug, bool verbose) {
+  std::cout
+    << "Job " << job.job << ":" << std::endl
+    << "  Command-line:";
+  for (auto &arg : job.commandline) std::cout << " " << shell_escape(arg);
+  std::cout
+    << std::endl
+    << "  Environment:" << std::endl;
+  for (auto &env : job.environment)
+    std::cout << "    " << shell_escape(env) << std::endl;
+  std::cout
+    << "  Directory: " << job.directory << std::endl
+    << "  Built:     " << job.time << std::endl
+    << "  Runtime:   " << job.usage.runtime << std::endl
+    << "  CPUtime:   " << job.usage.cputime << std::endl
+    << "  Mem bytes: " << job.usage.membytes << std::endl
+    << "  In  bytes: " << job.usage.ibytes << std::endl
+    << "  Out bytes: " << job.usage.obytes << std::endl
+    << "  Status:    " << job.usage.status << std::endl
+    << "  Stdin:     " << job.stdin << std::endl;
+  if (verbose) {
+    std::cout << "Visible:" << std::endl;
+    for (auto &in : job.visible)
       std::cout << "  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
                 << " " << in.path << std::endl;
-    std::cout << "Outputs:" << std::endl;
-    for (auto &out : job.outputs)
-      std::cout << "  " << out.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
-                << " " << out.path << std::endl;
-    if (debug) {
-      std::cout << "Stack:";
-      indent("  ", job.stack);
-    }
-    if (!job.stdout.empty()) {
-      std::cout << "Stdout:";
-      indent("  ", job.stdout);
-    }
-    if (!job.stderr.empty()) {
-      std::cout << "Stderr:";
-      indent("  ", job.stderr);
-    }
+  }
+  std::cout << "Inputs:" << std::endl;
+  for (auto &in : job.inputs)
+    std::cout << "  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
+              << " " << in.path << std::endl;
+  std::cout << "Outputs:" << std::endl;
+  for (auto &out : job.outputs)
+    std::cout << "  " << out.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
+              << " " << out.path << std::endl;
+  if (debug) {
+    std::cout << "Stack:";
+    indent("  ", job.stack);
+  }
+  if (!job.stdout.empty()) {
+    std::cout << "Stdout:";
+    indent("  ", job.stdout);
+  }
+  if (!job.stderr.empty()) {
+    std::cout << "Stderr:";
+    indent("  ", job.stderr);
   }
 }
 
-static void describe_shell(const std::vector<JobReflection> &jobs, bool debug, bool verbose) {
-  std::cout << "#! /bin/sh -ex" << std::endl;
-
-  for (auto &job : jobs) {
-    std::cout << std::endl << "# Wake job " << job.job << ":" << std::endl;
-    std::cout << "cd " << shell_escape(get_cwd()) << std::endl;
-    if (job.directory != ".") {
-      std::cout << "cd " << shell_escape(job.directory) << std::endl;
-    }
-    std::cout << "env -i \\" << std::endl;
-    for (auto &env : job.environment) {
-      std::cout << "\t" << shell_escape(env) << " \\" << std::endl;
-    }
-    for (auto &arg : job.commandline) {
-      std::cout << shell_escape(arg) << " \\" << std::endl << '\t';
-    }
-    std::cout << "< " << shell_escape(job.stdin) << std::endl << std::endl;
-    std::cout
-      << "# When wake ran this command:" << std::endl
-      << "#   Built:     " << job.time << std::endl
-      << "#   Runtime:   " << job.usage.runtime << std::endl
-      << "#   CPUtime:   " << job.usage.cputime << std::endl
-      << "#   Mem bytes: " << job.usage.membytes << std::endl
-      << "#   In  bytes: " << job.usage.ibytes << std::endl
-      << "#   Out bytes: " << job.usage.obytes << std::endl
-      << "#   Status:    " << job.usage.status << std::endl;
-    if (verbose) {
-      std::cout << "# Visible:" << std::endl;
-      for (auto &in : job.visible)
-        std::cout << "#  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
-                  << " " << in.path << std::endl;
-    }
-    std::cout
-      << "# Inputs:" << std::endl;
-    for (auto &in : job.inputs)
+static void describe_shell(const JobReflection &job, bool debug, bool verbose) {
+  std::cout << std::endl << "# Wake job " << job.job << ":" << std::endl;
+  std::cout << "cd " << shell_escape(get_cwd()) << std::endl;
+  if (job.directory != ".") {
+    std::cout << "cd " << shell_escape(job.directory) << std::endl;
+  }
+  std::cout << "env -i \\" << std::endl;
+  for (auto &env : job.environment) {
+    std::cout << "\t" << shell_escape(env) << " \\" << std::endl;
+  }
+  for (auto &arg : job.commandline) {
+    std::cout << shell_escape(arg) << " \\" << std::endl << '\t';
+  }
+  std::cout << "< " << shell_escape(job.stdin) << std::endl << std::endl;
+  std::cout
+    << "# When wake ran this command:" << std::endl
+    << "#   Built:     " << job.time << std::endl
+    << "#   Runtime:   " << job.usage.runtime << std::endl
+    << "#   CPUtime:   " << job.usage.cputime << std::endl
+    << "#   Mem bytes: " << job.usage.membytes << std::endl
+    << "#   In  bytes: " << job.usage.ibytes << std::endl
+    << "#   Out bytes: " << job.usage.obytes << std::endl
+    << "#   Status:    " << job.usage.status << std::endl;
+  if (verbose) {
+    std::cout << "# Visible:" << std::endl;
+    for (auto &in : job.visible)
       std::cout << "#  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
                 << " " << in.path << std::endl;
-    std::cout << "# Outputs:" << std::endl;
-    for (auto &out : job.outputs)
-      std::cout << "#  " << out.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
-                << " " << out.path << std::endl;
-    if (debug) {
-      std::cout << "# Stack:";
-      indent("#   ", job.stack);
-    }
-    if (!job.stdout.empty()) {
-      std::cout << "Stdout:";
-      indent("#   ", job.stdout);
-    }
-    if (!job.stderr.empty()) {
-      std::cout << "Stderr:";
-      indent("#   ", job.stderr);
-    }
   }
+  std::cout
+    << "# Inputs:" << std::endl;
+  for (auto &in : job.inputs)
+    std::cout << "#  " << in.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
+              << " " << in.path << std::endl;
+  std::cout << "# Outputs:" << std::endl;
+  for (auto &out : job.outputs)
+    std::cout << "#  " << out.hash.substr(0, verbose?std::string::npos:SHORT_HASH)
+              << " " << out.path << std::endl;
+  if (debug) {
+    std::cout << "# Stack:";
+    indent("#   ", job.stack);
+  }
+  if (!job.stdout.empty()) {
+    std::cout << "Stdout:";
+    indent("#   ", job.stdout);
+  }
+  if (!job.stderr.empty()) {
+    std::cout << "Stderr:";
+    indent("#   ", job.stderr);
+  }
+}
+
+static void json_files(const char *key, const std::vector<FileReflection> &files) {
+  std::cout << ",\"" << key << "\":[";
+  bool first = true;
+  for (auto &f : files) {
+    if (!first) std::cout << ",";
+    first = false;
+    std::cout << "{\"path\":\"" << json_escape(f.path) << "\",\"hash\":\"" << f.hash << "\"}";
+  }
+  std::cout << "]";
+}
+
+static void json_strings(const char *key, const std::vector<std::string> &strs) {
+  std::cout << ",\"" << key << "\":[";
+  bool first = true;
+  for (auto &x : strs) {
+    if (!first) std::cout << ",";
+    first = false;
+    std::cout << "\"" << json_escape(x) << "\"";
+  }
+  std::cout << "]";
+}
+
+// One object per line, so consumers can process jobs as they arrive
+static void describe_json(const JobReflection &job, bool debug, bool verbose) {
+  std::cout
+    << "{\"job\":" << job.job
+    << ",\"directory\":\"" << json_escape(job.directory) << "\"";
+  json_strings("commandline", job.commandline);
+  json_strings("environment", job.environment);
+  std::cout
+    << ",\"stdin\":\"" << json_escape(job.stdin) << "\""
+    << ",\"time\":\"" << json_escape(job.time) << "\""
+    << ",\"status\":" << job.usage.status
+    << ",\"runtime\":" << job.usage.runtime
+    << ",\"cputime\":" << job.usage.cputime
+    << ",\"membytes\":" << job.usage.membytes
+    << ",\"ibytes\":" << job.usage.ibytes
+    << ",\"obytes\":" << job.usage.obytes;
+  if (verbose) json_files("visible", job.visible);
+  json_files("inputs", job.inputs);
+  json_files("outputs", job.outputs);
+  if (debug) std::cout << ",\"stack\":\"" << json_escape(job.stack) << "\"";
+  if (verbose) {
+    std::cout
+      << ",\"stdout\":\"" << json_escape(job.stdout) << "\""
+      << ",\"stderr\":\"" << json_escape(job.stderr) << "\"";
+  }
+  std::cout << "}" << std::endl;
+}
+
+void describe_start(DescribeFormat format) {
+  if (format == DESCRIBE_SHELL)
+    std::cout << "#! /bin/sh -ex" << std::endl;
 }
 
-void describe(const std::vector<JobReflection> &jobs, bool script, bool debug, bool verbose) {
-  if (script) {
-    describe_shell(jobs, debug, verbose);
-  } else {
-    describe_human(jobs, debug, verbose);
+void describe(const JobReflection &job, DescribeFormat format, bool debug, bool verbose) {
+  switch (format) {
+    case DESCRIBE_HUMAN: describe_human(job, debug, verbose); break;
+    case DESCRIBE_SHELL: describe_shell(job, debug, verbose); break;
+    case DESCRIBE_JSON:  describe_json (job, debug, verbose); break;
+  }
+}
+
+void describe_impact(const std::vector<ImpactReflection> &jobs, DescribeFormat format) {
+  double total = 0;
+  for (auto &x : jobs) total += x.runtime;
+
+  if (format == DESCRIBE_JSON) {
+    for (auto &x : jobs) {
+      std::cout << "{\"job\":" << x.job << ",\"depth\":" << x.depth << ",\"runtime\":" << x.runtime;
+      json_strings("commandline", x.commandline);
+      std::cout << "}" << std::endl;
+    }
+    return;
+  }
+
+  std::cout << "Impacted jobs: " << jobs.size() << ", predicted runtime " << total << "s" << std::endl;
+  for (auto &x : jobs) {
+    std::cout << "  " << x.job << " depth " << x.depth << " " << x.runtime << "s:";
+    for (auto &arg : x.commandline) std::cout << " " << shell_escape(arg);
+    std::cout << std::endl;
   }
 }
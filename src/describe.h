@@ -19,8 +19,13 @@
 #define DESCRIBE
 
 #include "database.h"
-#include <vector>
 
-void describe(const std::vector<JobReflection> &jobs, bool script, bool debug, bool verbose);
+enum DescribeFormat { DESCRIBE_HUMAN, DESCRIBE_SHELL, DESCRIBE_JSON };
+
+// Call describe_start once, then describe for each job as it is found
+void describe_start(DescribeFormat format);
+void describe(const JobReflection &job, DescribeFormat format, bool debug, bool verbose);
+// Summarize the jobs a change would rerun; DESCRIBE_SHELL is not supported
+void describe_impact(const std::vector<ImpactReflection> &jobs, DescribeFormat format);
 
 #endif
@@ -24,6 +24,7 @@
 #include "execpath.h"
 #include "status.h"
 #include "shell.h"
+#include "cgroup.h"
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/select.h>
@@ -31,6 +32,10 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -39,10 +44,15 @@
 #include <sstream>
 #include <iostream>
 #include <list>
+#include <map>
 #include <vector>
 #include <cstring>
 #include <algorithm>
 #include <limits>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
 
 // How many times to SIGTERM a process before SIGKILL
 #define TERM_ATTEMPTS 6
@@ -52,6 +62,18 @@
 #define MAX_SELF_FDS	24
 // The most children wake will ever allow to run at once
 #define MAX_CHILDREN	500
+// How often the job limit is adapted to system pressure (PSI averages update every 2s)
+#define PRESSURE_PERIOD_S 2
+// How long a job which exceeded its timeout has to exit after SIGTERM before SIGKILL
+#define TIMEOUT_GRACE_S 10
+// Straggler detection never kills a job which has run for less than this
+#define STRAGGLER_MIN_S 60
+// The most samples kept in a job's resource profile (older samples are merged pairwise)
+#define PROFILE_SAMPLES 128
+// The most job completions recorded in one database transaction
+#define FINISH_BATCH 64
+// The most bytes moved by one splice() of output which is not echoed (a full pipe is 1MiB by default)
+#define SPLICE_BYTES (1024*1024)
 
 // #define DEBUG_PROGRESS
 
@@ -68,8 +90,9 @@
 #define LOG_ECHO(x) (x & 0x10)
 
 // Can be queried at multiple stages of the job's lifetime
-struct Job final : public GCObject<Job> {
-  typedef GCObject<Job> Parent;
+// Destroyable, because its resource profiles own their samples
+struct Job final : public GCObject<Job, DestroyableObject> {
+  typedef GCObject<Job, DestroyableObject> Parent;
 
   Database *db;
   HeapPointer<String> cmdline, stdin, dir;
@@ -85,7 +108,11 @@ struct Job final : public GCObject<Job> {
   Usage record;  // retrieved from DB (user-facing usage)
   Usage predict; // prediction of Runners given record (used by scheduler)
   Usage reality; // actual measured local usage
+  bool accounted; // reality covers the whole process tree (from a cgroup)
+  double timeout; // seconds the job may run; 0 => use the JobTable policy
   Usage report;  // usage to save into DB + report in Job API
+  Profile history; // sampled resource use of the previous run (if any)
+  Profile profile; // sampled resource use of this run
 
   // There are 4 distinct wait queues for jobs
   HeapPointer<Continuation> q_stdout;  // waken once stdout closed
@@ -96,7 +123,8 @@ struct Job final : public GCObject<Job> {
   HeapPointer<Continuation> q_report;  // waken once job finished (inputs+outputs+report available)
 
   static TypeVar typeVar;
-  Job(Database *db_, String *dir_, String *stdin_, String *environ, String *cmdline_, bool keep, int log);
+  Job(Heap &h, Database *db_, String *dir_, String *stdin_, String *environ, String *cmdline_, bool keep, int log);
+  Job(Job &&job) = default;
 
   template <typename T, T (HeapPointerBase::*memberfn)(T x)>
   T recurse(T arg);
@@ -198,6 +226,9 @@ double Job::threads() const {
   return estimate;
 }
 
+// Critical path length (pathtime) => recorded runtime, for every pending or running job
+typedef std::multimap<double, double> CriticalIndex;
+
 // A Task is a job that is not yet forked
 struct Task {
   RootPointer<Job> job;
@@ -205,8 +236,9 @@ struct Task {
   std::string stdin;
   std::string environ;
   std::string cmdline;
-  Task(RootPointer<Job> &&job_, const std::string &dir_, const std::string &stdin_, const std::string &environ_, const std::string &cmdline_)
-  : job(std::move(job_)), dir(dir_), stdin(stdin_), environ(environ_), cmdline(cmdline_) { }
+  CriticalIndex::iterator crit;
+  Task(RootPointer<Job> &&job_, const std::string &dir_, const std::string &stdin_, const std::string &environ_, const std::string &cmdline_, CriticalIndex::iterator crit_)
+  : job(std::move(job_)), dir(dir_), stdin(stdin_), environ(environ_), cmdline(cmdline_), crit(crit_) { }
 };
 
 static bool operator < (const std::unique_ptr<Task> &x, const std::unique_ptr<Task> &y) {
@@ -219,24 +251,144 @@ static bool operator < (const std::unique_ptr<Task> &x, const std::unique_ptr<Ta
   return x->job->pathtime < y->job->pathtime;
 }
 
+// A job output stream captured straight into its file in OUTPUT_DIR (--log-files)
+struct LogFile {
+  int fd;         // -1 unless capturing
+  int tee[2];     // receives a copy of the stream if it is echoed; else -1
+  bool echo;      // the stream must also be returned to the caller
+  long offset;    // bytes written to fd
+  double indexed; // runtime when the offset was last saved to the database
+  LogFile() : fd(-1), echo(false), offset(0), indexed(-1) { tee[0] = tee[1] = -1; }
+
+  bool open(const std::string &file, bool echo);
+  int capture(int pipe, char *buffer, int size);
+  void index(Database *db, long job, int descriptor, double runtime, bool force);
+  void close();
+};
+
+bool LogFile::open(const std::string &file, bool echo_) {
+  fd = ::open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  if (fd == -1) return false;
+  echo = echo_;
+  // Without a tee pipe (eg: EMFILE), capture falls back to read() and pwrite()
+  int flags;
+  if (echo && pipe(tee) == 0) {
+    if ((flags = fcntl(tee[0], F_GETFD, 0)) != -1) fcntl(tee[0], F_SETFD, flags | FD_CLOEXEC);
+    if ((flags = fcntl(tee[1], F_GETFD, 0)) != -1) fcntl(tee[1], F_SETFD, flags | FD_CLOEXEC);
+  }
+  return true;
+}
+
+// Move the pending output of pipe into the file, without copying it through wake.
+// Echoed output is duplicated with tee() and the copy returned in buffer.
+// size bounds only what lands in buffer; output which is not echoed moves up to SPLICE_BYTES.
+// Returns like read(): >0 bytes moved, 0 at end-of-file, -1 on error.
+int LogFile::capture(int pipe, char *buffer, int size) {
+  ssize_t got = -1;
+  errno = EINVAL;
+#ifdef __linux__
+  loff_t off = offset;
+  if (tee[1] != -1) {
+    got = ::tee(pipe, tee[1], size, SPLICE_F_NONBLOCK);
+    if (got > 0) {
+      ssize_t moved = 0, step = 0;
+      while (moved < got && (step = splice(pipe, 0, fd, &off, got - moved, SPLICE_F_MOVE)) > 0)
+        moved += step;
+      if (read(tee[0], buffer, got) != got || moved != got) got = -1;
+    }
+  } else if (!echo) {
+    got = splice(pipe, 0, fd, &off, SPLICE_BYTES, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  }
+  if (got < 0 && errno == EAGAIN) errno = EINTR; // raced with select; try again later
+#endif
+  // The filesystem cannot splice, or echoed output has no tee pipe
+  if (got < 0 && errno == EINVAL) {
+    got = read(pipe, buffer, size);
+    if (got > 0 && pwrite(fd, buffer, got, offset) != got) got = -1;
+  }
+  if (got > 0) offset += got;
+  return got;
+}
+
+// Record how much output exists at this runtime; at most once a second unless forced
+void LogFile::index(Database *db, long job, int descriptor, double runtime, bool force) {
+  if (!force && runtime - indexed < 1) return;
+  db->index_output(job, descriptor, offset, runtime);
+  indexed = runtime;
+}
+
+void LogFile::close() {
+  if (fd != -1) ::close(fd);
+  if (tee[0] != -1) ::close(tee[0]);
+  if (tee[1] != -1) ::close(tee[1]);
+  fd = tee[0] = tee[1] = -1;
+  echo = false;
+}
+
 // A JobEntry is a forked job with pid|stdout|stderr incomplete
 struct JobEntry {
   RootPointer<Job> job; // if unset, available for reuse
   pid_t pid;       //  0 if merged
+  pid_t pgid;      //  process group of the job (outlives pid); 0 if not launched
   int pipe_stdout; // -1 if closed
   int pipe_stderr; // -1 if closed
   std::string stdout_buf;
   std::string stderr_buf;
+  LogFile log_stdout;
+  LogFile log_stderr;
   struct timeval start;
   std::list<Status>::iterator status;
-  JobEntry(RootPointer<Job> &&job_) : job(std::move(job_)), pid(0), pipe_stdout(-1), pipe_stderr(-1) { }
-  double runtime(struct timeval now);
+  CriticalIndex::iterator crit; // valid until merged
+  double deadline; // runtime at which to signal the job; 0 => never
+  int signals;     // signals sent to the job since it timed out
+  // Resource sampling state
+  uint64_t membytes; // resident memory at the last sample
+  uint64_t cputicks; // CPU time consumed by the process group at the last sample
+  double sampled;    // runtime of the last sample
+  double bucket;     // runtime at which the unrecorded profile sample began
+  uint64_t peak;     // most memory seen since bucket
+  double busy;       // CPU seconds used since bucket
+  JobEntry(RootPointer<Job> &&job_, CriticalIndex::iterator crit_) : job(std::move(job_)), pid(0), pgid(0), pipe_stdout(-1), pipe_stderr(-1), crit(crit_), deadline(0), signals(0),
+    membytes(0), cputicks(0), sampled(0), bucket(0), peak(0), busy(0) { }
+  double runtime(struct timeval now) const;
+  void record(double stride);
 };
 
-double JobEntry::runtime(struct timeval now) {
+double JobEntry::runtime(struct timeval now) const {
   return now.tv_sec - start.tv_sec + (now.tv_usec - start.tv_usec)/1000000.0;
 }
 
+// Close the current profile bucket; halve the resolution once the profile is full
+void JobEntry::record(double stride) {
+  Profile &p = job->profile;
+  if (p.interval == 0) p.interval = stride;
+  if (sampled > bucket) {
+    p.membytes.push_back(peak);
+    p.cpus.push_back(busy / (sampled - bucket));
+  }
+  bucket = sampled;
+  peak = 0;
+  busy = 0;
+
+  if (p.membytes.size() < PROFILE_SAMPLES) return;
+  for (size_t i = 0; i < PROFILE_SAMPLES/2; ++i) {
+    p.membytes[i] = std::max(p.membytes[2*i], p.membytes[2*i+1]);
+    p.cpus[i] = (p.cpus[2*i] + p.cpus[2*i+1]) / 2;
+  }
+  p.membytes.resize(PROFILE_SAMPLES/2);
+  p.cpus.resize(PROFILE_SAMPLES/2);
+  p.interval *= 2;
+}
+
+// Memory a job is expected to hold from now until it finishes
+static uint64_t expect_memory(const Job *job, double elapsed) {
+  const Profile &h = job->history;
+  if (h.membytes.empty()) return job->predict.membytes;
+  size_t start = elapsed / h.interval;
+  if (start >= h.membytes.size()) return h.membytes.back();
+  return *std::max_element(h.membytes.begin() + start, h.membytes.end());
+}
+
 struct CriticalJob {
   double pathtime;
   double runtime;
@@ -246,37 +398,259 @@ struct CriticalJob {
 struct JobTable::detail {
   std::list<JobEntry> running;
   std::vector<std::unique_ptr<Task> > pending;
+  CriticalIndex critical; // pending + unmerged running jobs
+  std::unordered_set<pid_t> groups; // process groups of jobs with unreaped members
   sigset_t block; // signals that can race with pselect()
   Database *db;
   double active, limit; // CPUs
+  double max_limit; // ceiling for limit when adapting to pressure
+  double pressure; // target PSI stall percentage; 0 => limit is fixed
+  struct timeval sampled; // last time pressure was read
+  double timeout; // seconds any job may run; 0 => unlimited
+  double straggler; // jobs may run this multiple of their predicted runtime; 0 => unlimited
+  double interval; // seconds between resource samples of running jobs; 0 => off
+  struct timeval profiled; // last time running jobs were sampled
+  uint64_t memory; // physical memory which running jobs are expected to share
+  bool log_files; // capture job output into OUTPUT_DIR instead of the database
   long max_children; // hard cap on jobs allowed
   bool verbose;
   bool quiet;
   bool check;
+  int batched; // job completions recorded in the open transaction
   struct timeval wall;
+  std::thread prefetch;
+  std::atomic<bool> prefetch_stop;
 
   CriticalJob critJob(double nexttime) const;
+  bool adapt(struct timeval now);
+  double deadline(const Job *job) const;
+  double expire(struct timeval now) const;
+  void enforce(struct timeval now);
+  bool sample(struct timeval now);
+  bool memory_ok(const Job *next) const;
+  void prune_groups();
+  void commit();
 };
 
 CriticalJob JobTable::detail::critJob(double nexttime) const {
   CriticalJob out;
   out.pathtime = nexttime;
   out.runtime = 0;
-  for (auto &j : running) {
-    if (j.pid && j.job->pathtime > out.pathtime) {
-      out.pathtime = j.job->pathtime;
-      out.runtime = j.job->record.runtime;
+  if (!critical.empty()) {
+    auto longest = critical.rbegin();
+    if (longest->first > out.pathtime) {
+      out.pathtime = longest->first;
+      out.runtime = longest->second;
     }
   }
-  for (auto &j : pending) {
-    if (j->job->pathtime > out.pathtime) {
-      out.pathtime = j->job->pathtime;
-      out.runtime = j->job->record.runtime;
+  return out;
+}
+
+// Commit the job completions batched since the last wait
+void JobTable::detail::commit() {
+  if (batched == 0) return;
+  db->end_txn();
+  batched = 0;
+}
+
+// Forget process groups whose last member was reaped, before their pgid can be reused.
+// As subreaper, wake reaps every member itself, so a group cannot vanish between reaps.
+void JobTable::detail::prune_groups() {
+  for (auto it = groups.begin(); it != groups.end(); ) {
+    if (kill(-*it, 0) != 0 && errno == ESRCH) {
+      it = groups.erase(it);
+    } else {
+      ++it;
     }
   }
+}
+
+// Parse the 'some avg10' stall percentage from a /proc/pressure file; -1 if unavailable
+static double read_pressure(const char *file) {
+  char buf[256];
+  int fd = open(file, O_RDONLY);
+  if (fd == -1) return -1;
+  ssize_t got = read(fd, buf, sizeof(buf)-1);
+  close(fd);
+  if (got <= 0) return -1;
+  buf[got] = 0;
+  const char *avg = strstr(buf, "some avg10=");
+  if (!avg) return -1;
+  return strtod(avg + 11, 0);
+}
+
+// Adjust the CPU limit to hold pressure near the target; true if the limit grew
+bool JobTable::detail::adapt(struct timeval now) {
+  if (pressure == 0 || now.tv_sec - sampled.tv_sec < PRESSURE_PERIOD_S) return false;
+  sampled = now;
+
+  double cpu = read_pressure("/proc/pressure/cpu");
+  double mem = read_pressure("/proc/pressure/memory");
+  double io  = read_pressure("/proc/pressure/io");
+  double worst = std::max(cpu, std::max(mem, io));
+  if (worst < 0) {
+    std::string out = "Pressure stall information is unavailable; using a fixed job limit\n";
+    status_write(2, out.data(), out.size());
+    pressure = 0;
+    return false;
+  }
+
+  // Back off quickly when the system is overloaded; grow slowly only while saturated
+  double old = limit;
+  if (worst > pressure) {
+    limit = std::max(1.0, limit * 0.8);
+  } else if (worst < pressure/2 && active >= limit) {
+    limit = std::min(max_limit, limit + 1);
+  }
+
+  if (limit == old) return false;
+  db->record_limit(cpu, mem, io, old, limit);
+
+  if (verbose) {
+    std::stringstream s;
+    s << "Pressure cpu=" << cpu << "% mem=" << mem << "% io=" << io
+      << "%; job limit " << old << " => " << limit << std::endl;
+    std::string out = s.str();
+    status_write(1, out.data(), out.size());
+  }
+
+  return limit > old;
+}
+
+// The per-job timeout wins; otherwise the tighter of the global and straggler limits
+double JobTable::detail::deadline(const Job *job) const {
+  if (job->timeout > 0) return job->timeout;
+  double out = timeout;
+  if (straggler > 0 && job->predict.status == 0 && job->predict.runtime > 0) {
+    double slow = std::max(straggler * job->predict.runtime, (double)STRAGGLER_MIN_S);
+    if (out == 0 || slow < out) out = slow;
+  }
+  return out;
+}
+
+// Seconds until the next running job must be signalled; -1 if none
+double JobTable::detail::expire(struct timeval now) const {
+  double out = -1;
+  for (auto &i : running) {
+    if (i.pid == 0 || i.deadline == 0) continue;
+    double left = std::max(0.0, i.deadline - i.runtime(now));
+    if (out < 0 || left < out) out = left;
+  }
   return out;
 }
 
+// SIGTERM the process group of jobs past their deadline, then SIGKILL after a grace period
+void JobTable::detail::enforce(struct timeval now) {
+  for (auto &i : running) {
+    if (i.pid == 0 || i.deadline == 0 || i.runtime(now) < i.deadline) continue;
+    std::stringstream s;
+    if (i.signals++ == 0) {
+      s << "Job " << i.job->job << " exceeded its timeout of " << i.deadline
+        << "s; sending SIGTERM" << std::endl;
+      kill(-i.pid, SIGTERM);
+      i.deadline += TIMEOUT_GRACE_S;
+    } else {
+      s << "Force killing job " << i.job->job << " after " << TIMEOUT_GRACE_S
+        << "s grace with SIGTERM" << std::endl;
+      kill(-i.pid, SIGKILL);
+      i.deadline = 0;
+    }
+    std::string out = s.str();
+    status_write(2, out.data(), out.size());
+  }
+}
+
+struct GroupSample {
+  uint64_t rss;   // pages
+  uint64_t ticks; // user+system time of the members and their reaped children
+  GroupSample() : rss(0), ticks(0) { }
+};
+
+// Sum the resources used by each process group in groups; false if /proc is unavailable
+static bool sample_groups(std::unordered_map<pid_t, GroupSample> &groups) {
+  DIR *proc = opendir("/proc");
+  if (!proc) return false;
+
+  char path[64], buf[1024];
+  while (struct dirent *e = readdir(proc)) {
+    if (e->d_name[0] < '0' || e->d_name[0] > '9') continue;
+    snprintf(path, sizeof(path), "/proc/%s/stat", e->d_name);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) continue;
+    ssize_t got = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (got <= 0) continue;
+    buf[got] = 0;
+
+    // The command name may contain anything, so parse from the last ')'
+    const char *fields = strrchr(buf, ')');
+    int pgrp;
+    unsigned long utime, stime;
+    long cutime, cstime, rss;
+    if (!fields || sscanf(fields + 2,
+        "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld %*d %*d %*d %*d %*u %*u %ld",
+        &pgrp, &utime, &stime, &cutime, &cstime, &rss) != 6) continue;
+
+    auto group = groups.find(pgrp);
+    if (group == groups.end()) continue;
+    group->second.rss += std::max(rss, 0L);
+    group->second.ticks += utime + stime + std::max(cutime, 0L) + std::max(cstime, 0L);
+  }
+
+  closedir(proc);
+  return true;
+}
+
+// Add a sample of memory and CPU use to the profile of every running job
+bool JobTable::detail::sample(struct timeval now) {
+  if (interval == 0) return false;
+  double since = now.tv_sec - profiled.tv_sec + (now.tv_usec - profiled.tv_usec)/1000000.0;
+  if (since < interval) return false;
+  profiled = now;
+
+  std::unordered_map<pid_t, GroupSample> groups;
+  for (auto &i : running)
+    if (i.pid != 0) groups[i.pgid];
+  if (groups.empty()) return false;
+
+  if (!sample_groups(groups)) {
+    std::string out = "Cannot read /proc; job resource sampling disabled\n";
+    status_write(2, out.data(), out.size());
+    interval = 0;
+    return false;
+  }
+
+  static long page = sysconf(_SC_PAGESIZE);
+  static long hz = sysconf(_SC_CLK_TCK);
+  for (auto &i : running) {
+    if (i.pid == 0) continue;
+    GroupSample &g = groups[i.pgid];
+    double at = i.runtime(now);
+    i.membytes = g.rss * page;
+    i.peak = std::max(i.peak, i.membytes);
+    if (g.ticks > i.cputicks) i.busy += (g.ticks - i.cputicks) / (double)hz;
+    i.cputicks = g.ticks;
+    i.sampled = at;
+    double stride = i.job->profile.interval ? i.job->profile.interval : interval;
+    if (at - i.bucket >= stride) i.record(interval);
+  }
+
+  return true;
+}
+
+// Admit the next job if it fits beside the memory expected of running jobs.
+// A job which does not fit on its own still runs once nothing else is, for forward progress.
+bool JobTable::detail::memory_ok(const Job *next) const {
+  if (interval == 0 || memory == 0) return true;
+  struct timeval now;
+  gettimeofday(&now, 0);
+  uint64_t committed = 0;
+  for (auto &i : running)
+    if (i.pid != 0)
+      committed += std::max(i.membytes, expect_memory(i.job.get(), i.runtime(now)));
+  return committed == 0 || committed + expect_memory(next, 0) < memory;
+}
+
 static volatile bool child_ready = false;
 static volatile bool exit_asap = false;
 
@@ -294,13 +668,33 @@ bool JobTable::exit_now() {
   return exit_asap;
 }
 
-JobTable::JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool check) : imp(new JobTable::detail) {
+JobTable::JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool check, double pressure, double timeout, double straggler, double sample, bool log_files) : imp(new JobTable::detail) {
   imp->verbose = verbose;
   imp->quiet = quiet;
   imp->check = check;
   imp->db = db;
   imp->active = 0;
   imp->limit = max_jobs;
+  imp->max_limit = pressure ? 2 * max_jobs : max_jobs;
+  imp->pressure = pressure;
+  imp->timeout = timeout;
+  imp->straggler = straggler;
+  imp->interval = sample;
+  imp->log_files = log_files;
+  imp->batched = 0;
+  if (log_files && ((mkdir(".build", 0775) != 0 && errno != EEXIST) ||
+                    (mkdir(OUTPUT_DIR, 0775) != 0 && errno != EEXIST))) {
+    perror("mkdir " OUTPUT_DIR);
+    exit(1);
+  }
+  memset(&imp->profiled, 0, sizeof(imp->profiled));
+#ifdef _SC_PHYS_PAGES
+  imp->memory = sample ? (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) : 0;
+#else
+  imp->memory = 0;
+#endif
+  memset(&imp->sampled, 0, sizeof(imp->sampled));
+  imp->prefetch_stop = false;
   sigemptyset(&imp->block);
 
   struct sigaction sa;
@@ -322,6 +716,11 @@ JobTable::JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool ch
   sigprocmask(SIG_BLOCK, &imp->block, 0);
   sigaction(SIGCHLD, &sa, 0);
 
+#ifdef __linux__
+  // Adopt processes orphaned by a job, so they are reaped by wake (and not init)
+  prctl(PR_SET_CHILD_SUBREAPER, 1);
+#endif
+
   // These signals cause wake to exit cleanly
   sa.sa_handler = handle_exit;
   sa.sa_flags = 0; // no SA_RESTART, because we want to terminate blocking calls
@@ -352,7 +751,7 @@ JobTable::JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool ch
   }
 
   // Calculate the maximum number of children to ever run
-  imp->max_children = max_jobs * 100; // based on minimum 1% CPU utilization in Job::threads
+  imp->max_children = imp->max_limit * 100; // based on minimum 1% CPU utilization in Job::threads
   if (imp->max_children > MAX_CHILDREN) imp->max_children = MAX_CHILDREN; // wake hard cap
 #ifdef CHILD_MAX
   if (imp->max_children > CHILD_MAX/2) imp->max_children = CHILD_MAX/2;   // limits.h
@@ -414,6 +813,12 @@ static struct timeval mytimerdouble(struct timeval a) {
 }
 
 JobTable::~JobTable() {
+  imp->commit();
+
+  // Abandon any remaining lookahead work
+  imp->prefetch_stop = true;
+  if (imp->prefetch.joinable()) imp->prefetch.join();
+
   // Disable the status refresh signal
   struct itimerval timer;
   memset(&timer, 0, sizeof(timer));
@@ -429,12 +834,10 @@ JobTable::~JobTable() {
   for (int retry = 0; children && retry < TERM_ATTEMPTS; ++retry, limit = mytimerdouble(limit)) {
     children = false;
 
-    // Send every child SIGTERM
-    for (auto &i : imp->running) {
-      if (i.pid == 0) continue;
-      children = true;
-      kill(i.pid, SIGTERM);
-    }
+    // Send every process group with a surviving member SIGTERM
+    for (auto pgid : imp->groups)
+      if (kill(-pgid, SIGTERM) == 0)
+        children = true;
 
     // Reap children for one second; exit early if none remain
     struct timeval start, now, remain;
@@ -460,26 +863,29 @@ JobTable::~JobTable() {
 
       pid_t pid;
       int status;
+      // As subreaper we also collect grandchildren orphaned by their job
+      bool reaped = false;
       while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
         if (WIFSTOPPED(status)) continue;
-
-        children = false;
-        for (auto &i : imp->running) {
+        reaped = true;
+        for (auto &i : imp->running)
           if (i.pid == pid) i.pid = 0;
-          if (i.pid != 0) children = true;
-        }
+      }
+
+      if (reaped) {
+        imp->prune_groups();
+        children = !imp->groups.empty();
       }
     }
   }
 
   // Force children to die
-  for (auto &i : imp->running) {
-    if (i.pid == 0) continue;
+  for (auto pgid : imp->groups) {
     std::stringstream s;
-    s << "Force killing " << i.pid << " after " << TERM_ATTEMPTS << " attempts with SIGTERM" << std::endl;
+    s << "Force killing process group " << pgid << " after " << TERM_ATTEMPTS << " attempts with SIGTERM" << std::endl;
     std::string out = s.str();
     status_write(2, out.data(), out.size());
-    kill(i.pid, SIGKILL);
+    kill(-pgid, SIGKILL);
   }
 }
 
@@ -543,11 +949,12 @@ static void launch(JobTable *jobtable) {
   auto &heap = jobtable->imp->pending;
   while (!heap.empty()
       && jobtable->imp->running.size() < (size_t)jobtable->imp->max_children
-      && jobtable->imp->active < jobtable->imp->limit) {
+      && jobtable->imp->active < jobtable->imp->limit
+      && jobtable->imp->memory_ok(heap.front()->job.get())) {
     Task &task = *heap.front();
     jobtable->imp->active += task.job->threads();
 
-    jobtable->imp->running.emplace_back(std::move(task.job));
+    jobtable->imp->running.emplace_back(std::move(task.job), task.crit);
     JobEntry &i = jobtable->imp->running.back();
 
     int pipe_stdout[2];
@@ -561,7 +968,16 @@ static void launch(JobTable *jobtable) {
     if ((flags = fcntl(pipe_stderr[0], F_GETFD, 0)) != -1) fcntl(pipe_stderr[0], F_SETFD, flags | FD_CLOEXEC);
     i.pipe_stdout = pipe_stdout[0];
     i.pipe_stderr = pipe_stderr[0];
+    if (jobtable->imp->log_files) {
+      long job = i.job->job;
+      if (!i.log_stdout.open(Database::output_file(job, 1), LOG_STDOUT(i.job->log)) ||
+          !i.log_stderr.open(Database::output_file(job, 2), LOG_STDERR(i.job->log))) {
+        perror("open " OUTPUT_DIR);
+        exit(1);
+      }
+    }
     gettimeofday(&i.start, 0);
+    i.deadline = jobtable->imp->deadline(i.job.get());
     std::stringstream prelude;
     prelude << find_execpath() << "/../lib/wake/shim-wake" << '\0'
       << (task.stdin.empty() ? "/dev/null" : task.stdin.c_str()) << '\0'
@@ -572,12 +988,26 @@ static void launch(JobTable *jobtable) {
     auto cmdline = split_null(shim);
     auto environ = split_null(task.environ);
 
+    // Prepared before vfork, so the child need not allocate
+    std::string cgroup;
+    if (cgroup_enabled()) cgroup = cgroup_create(i.job->job, i.job->predict.membytes);
+    const char *join = cgroup.empty() ? nullptr : cgroup.c_str();
+
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGCHLD);
     sigprocmask(SIG_UNBLOCK, &set, 0);
     pid_t pid = vfork();
     if (pid == 0) {
+      // Own process group, so a timeout can signal everything the job spawned
+      setpgid(0, 0);
+      if (join) {
+        int fd = open(join, O_WRONLY);
+        if (fd != -1) {
+          (void)!write(fd, "0", 1);
+          close(fd);
+        }
+      }
       execve(cmdline[0], cmdline, environ);
       _exit(127);
     }
@@ -585,7 +1015,8 @@ static void launch(JobTable *jobtable) {
 
     delete [] cmdline;
     delete [] environ;
-    i.job->pid = i.pid = pid;
+    i.job->pid = i.pid = i.pgid = pid;
+    jobtable->imp->groups.insert(pid);
     i.job->state |= STATE_FORKED;
     close(pipe_stdout[1]);
     close(pipe_stderr[1]);
@@ -632,6 +1063,7 @@ bool JobTable::wait(Runtime &runtime) {
   struct timespec nowait;
   memset(&nowait, 0, sizeof(nowait));
 
+  imp->commit();
   launch(this);
 
   bool compute = false;
@@ -658,6 +1090,19 @@ bool JobTable::wait(Runtime &runtime) {
 
     // Check for all signals that are now blocked
     struct timespec *timeout = 0;
+    struct timespec period;
+    struct timeval before;
+    gettimeofday(&before, 0);
+    // Wake up in time for periodic work and the next job deadline
+    double wait = imp->pressure != 0 ? PRESSURE_PERIOD_S : -1;
+    if (imp->interval != 0 && (wait < 0 || imp->interval < wait)) wait = imp->interval;
+    double expire = imp->expire(before);
+    if (expire >= 0 && (wait < 0 || expire < wait)) wait = expire;
+    if (wait >= 0) {
+      period.tv_sec = wait;
+      period.tv_nsec = (wait - period.tv_sec) * 1000000000.0;
+      timeout = &period;
+    }
     if (child_ready) timeout = &nowait;
     if (exit_now()) timeout = &nowait;
 
@@ -695,8 +1140,16 @@ bool JobTable::wait(Runtime &runtime) {
 
     if (retval > 0) for (auto &i : imp->running) {
       if (i.pipe_stdout != -1 && FD_ISSET(i.pipe_stdout, &set)) {
-        int got = read(i.pipe_stdout, buffer, sizeof(buffer));
-        if (got == 0 || (got < 0 && errno != EINTR)) {
+        int got = i.log_stdout.fd == -1
+          ? read(i.pipe_stdout, buffer, sizeof(buffer))
+          : i.log_stdout.capture(i.pipe_stdout, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+          // try again
+        } else if (got <= 0) {
+          if (i.log_stdout.fd != -1) {
+            i.log_stdout.index(i.job->db, i.job->job, 1, i.runtime(now), true);
+            i.log_stdout.close();
+          }
           close(i.pipe_stdout);
           i.pipe_stdout = -1;
           i.status->stdout = false;
@@ -711,7 +1164,11 @@ bool JobTable::wait(Runtime &runtime) {
             i.stdout_buf.clear();
           }
         } else {
-          i.job->db->save_output(i.job->job, 1, buffer, got, i.runtime(now));
+          if (i.log_stdout.fd == -1) {
+            i.job->db->save_output(i.job->job, 1, buffer, got, i.runtime(now));
+          } else {
+            i.log_stdout.index(i.job->db, i.job->job, 1, i.runtime(now), false);
+          }
           if (LOG_STDOUT(i.job->log)) {
             i.stdout_buf.append(buffer, got);
             size_t dump = i.stdout_buf.rfind('\n');
@@ -723,8 +1180,16 @@ bool JobTable::wait(Runtime &runtime) {
         }
       }
       if (i.pipe_stderr != -1 && FD_ISSET(i.pipe_stderr, &set)) {
-        int got = read(i.pipe_stderr, buffer, sizeof(buffer));
-        if (got == 0 || (got < 0 && errno != EINTR)) {
+        int got = i.log_stderr.fd == -1
+          ? read(i.pipe_stderr, buffer, sizeof(buffer))
+          : i.log_stderr.capture(i.pipe_stderr, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+          // try again
+        } else if (got <= 0) {
+          if (i.log_stderr.fd != -1) {
+            i.log_stderr.index(i.job->db, i.job->job, 2, i.runtime(now), true);
+            i.log_stderr.close();
+          }
           close(i.pipe_stderr);
           i.pipe_stderr = -1;
           i.status->stderr = false;
@@ -739,7 +1204,11 @@ bool JobTable::wait(Runtime &runtime) {
             i.stderr_buf.clear();
           }
         } else {
-          i.job->db->save_output(i.job->job, 2, buffer, got, i.runtime(now));
+          if (i.log_stderr.fd == -1) {
+            i.job->db->save_output(i.job->job, 2, buffer, got, i.runtime(now));
+          } else {
+            i.log_stderr.index(i.job->db, i.job->job, 2, i.runtime(now), false);
+          }
           if (LOG_STDERR(i.job->log)) {
             i.stderr_buf.append(buffer, got);
             size_t dump = i.stderr_buf.rfind('\n');
@@ -756,10 +1225,10 @@ bool JobTable::wait(Runtime &runtime) {
     pid_t pid;
     struct rusage rusage;
     child_ready = false;
+    bool reaped = false;
     while ((pid = wait4(-1, &status, WNOHANG, &rusage)) > 0) {
       if (WIFSTOPPED(status)) continue;
 
-      ++done;
       int code = 0;
       if (WIFEXITED(status)) {
         code = WEXITSTATUS(status);
@@ -767,9 +1236,13 @@ bool JobTable::wait(Runtime &runtime) {
         code = -WTERMSIG(status);
       }
 
+      // Adopted orphans are reaped too, but only our own children finish a job
       for (auto &i : imp->running) {
         if (i.pid == pid) {
+          ++done;
+          reaped = true;
           i.pid = 0;
+          imp->critical.erase(i.crit);
           i.status->merged = true;
           i.job->state |= STATE_MERGED;
           i.job->reality.found    = true;
@@ -777,9 +1250,18 @@ bool JobTable::wait(Runtime &runtime) {
           i.job->reality.runtime  = i.runtime(now);
           i.job->reality.cputime  = (rusage.ru_utime.tv_sec  + rusage.ru_stime.tv_sec) +
                                     (rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec)/1000000.0;
+#ifdef __APPLE__
           i.job->reality.membytes = rusage.ru_maxrss;
+#else
+          i.job->reality.membytes = rusage.ru_maxrss * UINT64_C(1024);
+#endif
           i.job->reality.ibytes   = rusage.ru_inblock * UINT64_C(512);
           i.job->reality.obytes   = rusage.ru_oublock * UINT64_C(512);
+          i.job->accounted = cgroup_enabled() && cgroup_collect(i.job->job, i.job->reality);
+          // Only a job killed by our SIGTERM/SIGKILL timed out; one may still exit on its own during the grace period
+          if (i.signals && WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL))
+            i.job->reality.status = STATUS_TIMEOUT;
+          if (imp->interval) i.record(imp->interval);
           runtime.heap.guarantee(WJob::reserve());
           runtime.schedule(WJob::claim(runtime.heap, i.job.get()));
 
@@ -799,6 +1281,17 @@ bool JobTable::wait(Runtime &runtime) {
       }
     }
 
+    if (reaped) imp->prune_groups();
+
+    // More jobs may be admitted if pressure has fallen
+    if (imp->adapt(now)) launch(this);
+
+    // Signal jobs which have run for too long
+    imp->enforce(now);
+
+    // Memory may have been released by running jobs
+    if (imp->sample(now)) launch(this);
+
     // In case the expected next critical job is never scheduled, fall back to the next
     double dwall = (now.tv_sec - imp->wall.tv_sec) + (now.tv_usec - imp->wall.tv_usec) / 1000000.0;
     if (status_state.current == 0 && dwall*5 > status_state.remain) {
@@ -819,8 +1312,8 @@ bool JobTable::wait(Runtime &runtime) {
   return compute;
 }
 
-Job::Job(Database *db_, String *dir_, String *stdin_, String *environ, String *cmdline_, bool keep_, int log_)
-  : db(db_), cmdline(cmdline_), stdin(stdin_), dir(dir_), state(0), code(), pid(0), job(-1), keep(keep_), log(log_)
+Job::Job(Heap &h, Database *db_, String *dir_, String *stdin_, String *environ, String *cmdline_, bool keep_, int log_)
+  : Parent(h), db(db_), cmdline(cmdline_), stdin(stdin_), dir(dir_), state(0), code(), pid(0), job(-1), keep(keep_), log(log_), accounted(false), timeout(0)
 {
   std::vector<uint64_t> codes;
   Hash(dir->c_str(), dir->size()).push(codes);
@@ -937,13 +1430,15 @@ static PRIMFN(prim_job_launch) {
 
   REQUIRE (job->state == 0);
 
+  auto crit = jobtable->imp->critical.emplace(job->pathtime, job->record.runtime);
   auto &heap = jobtable->imp->pending;
   heap.emplace_back(new Task(
     runtime.heap.root(job),
     dir->as_str(),
     stdin->as_str(),
     env->as_str(),
-    cmd->as_str()));
+    cmd->as_str(),
+    crit));
   std::push_heap(heap.begin(), heap.end());
 
   // If a scheduled job claims a longer critical path, we need to adjust the total path time
@@ -1011,7 +1506,7 @@ static PRIMFN(prim_job_virtual) {
 }
 
 static PRIMTYPE(type_job_create) {
-  return args.size() == 7 &&
+  return args.size() == 8 &&
     args[0]->unify(String::typeVar) &&
     args[1]->unify(String::typeVar) &&
     args[2]->unify(String::typeVar) &&
@@ -1019,12 +1514,13 @@ static PRIMTYPE(type_job_create) {
     args[4]->unify(String::typeVar) &&
     args[5]->unify(Integer::typeVar) &&
     args[6]->unify(Integer::typeVar) &&
+    args[7]->unify(Double::typeVar) &&
     out->unify(Job::typeVar);
 }
 
 static PRIMFN(prim_job_create) {
   JobTable *jobtable = static_cast<JobTable*>(data);
-  EXPECT(7);
+  EXPECT(8);
   STRING(dir, 0);
   STRING(stdin, 1);
   STRING(env, 2);
@@ -1032,8 +1528,10 @@ static PRIMFN(prim_job_create) {
   STRING(visible, 4);
   INTEGER_MPZ(keep, 5);
   INTEGER_MPZ(log, 6);
+  DOUBLE(timeout, 7);
 
   Job *out = Job::alloc(
+    runtime.heap,
     runtime.heap,
     jobtable->imp->db,
     dir,
@@ -1043,7 +1541,8 @@ static PRIMFN(prim_job_create) {
     mpz_cmp_si(keep,0),
     mpz_get_si(log));
 
-  out->record = jobtable->imp->db->predict_job(out->code.data[0], &out->pathtime);
+  out->record = jobtable->imp->db->predict_job(out->code.data[0], &out->pathtime, &out->history);
+  out->timeout = timeout->value;
 
   std::stringstream stack;
   for (auto &i : scope->stack_trace()) stack << i.file() << std::endl;
@@ -1132,7 +1631,7 @@ static PRIMFN(prim_job_cache) {
 
   HeapObject *joblist;
   if (reuse.found && !jobtable->imp->check) {
-    Job *jobp = Job::claim(runtime.heap, jobtable->imp->db, dir, stdin, env, cmd, true, 0);
+    Job *jobp = Job::claim(runtime.heap, runtime.heap, jobtable->imp->db, dir, stdin, env, cmd, true, 0);
     jobp->state = STATE_FORKED|STATE_STDOUT|STATE_STDERR|STATE_MERGED|STATE_FINISHED;
     jobp->job = job;
     jobp->record = reuse;
@@ -1244,7 +1743,7 @@ static PRIMFN(prim_job_kill) {
   if (mpz_cmp_si(arg1, 256) < 0 && mpz_cmp_si(arg1, 0) > 0) {
     int sig = mpz_get_si(arg1);
     if ((arg0->state & STATE_FORKED) && !(arg0->state & STATE_MERGED))
-      kill(arg0->pid, sig);
+      kill(-arg0->pid, sig);
   }
 
   RETURN(claim_unit(runtime.heap));
@@ -1327,6 +1826,7 @@ static PRIMTYPE(type_job_finish) {
 }
 
 static PRIMFN(prim_job_finish) {
+  JobTable *jobtable = static_cast<JobTable*>(data);
   EXPECT(9);
   JOB(job, 0);
   STRING(inputs, 1);
@@ -1341,8 +1841,22 @@ static PRIMFN(prim_job_finish) {
   parse_usage(&job->report, args+3, runtime, scope);
   job->report.found = true;
 
+  // The runner only saw a signal; the timeout is the real reason the job failed
+  if (job->reality.status == STATUS_TIMEOUT) job->report.status = STATUS_TIMEOUT;
+
+  // A runner wrapper only measures its own child; the cgroup saw every process
+  if (job->accounted) {
+    job->report.cputime  = job->reality.cputime;
+    job->report.membytes = job->reality.membytes;
+    job->report.ibytes   = job->reality.ibytes;
+    job->report.obytes   = job->reality.obytes;
+  }
+
   bool keep = !job->bad_launch && !job->bad_finish && job->keep && job->report.status == 0;
-  job->db->finish_job(job->job, inputs->as_str(), outputs->as_str(), job->code.data[0], keep, job->report);
+  // Completions share a transaction until the next wait, or until the batch is full
+  if (jobtable->imp->batched++ == 0) job->db->begin_txn();
+  job->db->finish_job(job->job, inputs->as_str(), outputs->as_str(), job->code.data[0], keep, job->report, job->profile);
+  if (jobtable->imp->batched == FINISH_BATCH) jobtable->imp->commit();
   job->state |= STATE_FINISHED;
 
   runtime.schedule(WJob::claim(runtime.heap, job));
@@ -1369,6 +1883,53 @@ static long stat_mod_ns(const char *file) {
   return modified;
 }
 
+// A job with any input modified since the last run will rerun and read all of its inputs
+static void prefetch_inputs(std::vector<std::vector<FileStamp> > jobs, std::atomic<bool> *stop) {
+  std::unordered_map<std::string, bool> changed;
+  std::unordered_set<std::string> fetched;
+
+  for (auto &inputs : jobs) {
+    bool rerun = false;
+    for (auto &in : inputs) {
+      if (*stop) return;
+      auto it = changed.find(in.path);
+      if (it == changed.end())
+        it = changed.emplace(in.path, stat_mod_ns(in.path.c_str()) != in.modified).first;
+      rerun |= it->second;
+    }
+    if (!rerun) continue;
+
+    for (auto &in : inputs) {
+      if (*stop) return;
+      if (!fetched.insert(in.path).second) continue;
+      int fd = open(in.path.c_str(), O_RDONLY);
+      if (fd == -1) continue;
+#ifdef POSIX_FADV_WILLNEED
+      posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+      close(fd);
+    }
+  }
+}
+
+void JobTable::lookahead() {
+  std::vector<std::vector<FileStamp> > inputs;
+  double crit = imp->db->lookahead(inputs);
+
+  // Until evaluation reaches the jobs themselves, assume the critical path is unchanged
+  status_state.total = crit;
+  status_state.remain = crit;
+  status_state.current = 0;
+  gettimeofday(&imp->wall, 0);
+
+  // Only the main thread may take SIGINT/SIGTERM/SIGALRM/SIGWINCH (pselect relies on it)
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  imp->prefetch = std::thread(prefetch_inputs, std::move(inputs), &imp->prefetch_stop);
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+}
+
 static PRIMFN(prim_add_hash) {
   JobTable *jobtable = static_cast<JobTable*>(data);
   EXPECT(2);
@@ -1509,6 +2070,17 @@ static PRIMFN(prim_job_record) {
   }
 }
 
+static PRIMTYPE(type_job_timeout_status) {
+  return args.size() == 0 &&
+    out->unify(Integer::typeVar);
+}
+
+static PRIMFN(prim_job_timeout_status) {
+  EXPECT(0);
+  MPZ out(STATUS_TIMEOUT);
+  RETURN(Integer::alloc(runtime.heap, out));
+}
+
 static PRIMTYPE(type_access) {
   return args.size() == 2 &&
     args[0]->unify(String::typeVar) &&
@@ -1533,7 +2105,7 @@ void prim_register_job(JobTable *jobtable, PrimMap &pmap) {
   prim_register(pmap, "job_create", prim_job_create, type_job_create,  0, jobtable);
   prim_register(pmap, "job_launch", prim_job_launch, type_job_launch,  0, jobtable);
   prim_register(pmap, "job_virtual",prim_job_virtual,type_job_virtual, 0, jobtable);
-  prim_register(pmap, "job_finish", prim_job_finish, type_job_finish,  0);
+  prim_register(pmap, "job_finish", prim_job_finish, type_job_finish,  0, jobtable);
   prim_register(pmap, "job_fail_launch", prim_job_fail_launch, type_job_fail, 0);
   prim_register(pmap, "job_fail_finish", prim_job_fail_finish, type_job_fail, 0);
   prim_register(pmap, "job_kill",   prim_job_kill,   type_job_kill,    0);
@@ -1544,6 +2116,7 @@ void prim_register_job(JobTable *jobtable, PrimMap &pmap) {
   prim_register(pmap, "job_reality",prim_job_reality,type_job_reality, PRIM_PURE);
   prim_register(pmap, "job_report", prim_job_report, type_job_report,  PRIM_PURE);
   prim_register(pmap, "job_record", prim_job_record, type_job_record,  PRIM_PURE);
+  prim_register(pmap, "job_timeout_status", prim_job_timeout_status, type_job_timeout_status, PRIM_PURE);
   prim_register(pmap, "add_hash",   prim_add_hash,   type_add_hash,    0, jobtable);
   // These are not pure, because they can't be reordered freely:
   prim_register(pmap, "get_hash",   prim_get_hash,   type_get_hash,    0, jobtable);
@@ -27,11 +27,13 @@ struct JobTable {
   struct detail;
   std::unique_ptr<detail> imp;
 
-  JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool check);
+  JobTable(Database *db, int max_jobs, bool verbose, bool quiet, bool check, double pressure, double timeout, double straggler, double sample, bool log_files);
   ~JobTable();
 
   // Wait for a job to complete; false -> no more active jobs
   bool wait(Runtime &runtime);
+  // Use the previous run to estimate build time and pre-read inputs of jobs likely to rerun
+  void lookahead();
   static bool exit_now();
 };
 
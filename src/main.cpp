@@ -42,6 +42,8 @@
 #include "shell.h"
 #include "markup.h"
 #include "describe.h"
+#include "cgroup.h"
+#include "startup.h"
 
 void print_help(const char *argv0) {
   std::cout << std::endl
@@ -55,7 +57,19 @@ void print_help(const char *argv0) {
     << "    --quiet    -q    Surpress report of launched jobs and final expressions"     << std::endl
     << "    --no-tty         Surpress interactive build progress interface"              << std::endl
     << "    --no-wait        Do not wait to obtain database lock; fail immediately"      << std::endl
+    << "    --shared-db      Let -i/-o/--list-tasks read wake.db during this build"      << std::endl
     << "    --no-workspace   Do not open a database or scan for sources files"           << std::endl
+    << "    --lookahead      Pre-read inputs and estimate build time from the last run"  << std::endl
+    << "    --pressure=PCT   Adapt the job limit to hold system stall time near PCT%"    << std::endl
+    << "    --cgroup         Measure each job's whole process tree in its own cgroup"    << std::endl
+    << "    --cgroup-limit   Like --cgroup, and kill jobs far above their memory record" << std::endl
+    << "    --timeout=SEC    Kill jobs which run longer than SEC seconds"                << std::endl
+    << "    --straggler=K    Kill jobs which run K times longer than their last run"     << std::endl
+    << "    --sample=SEC     Profile job memory every SEC seconds and schedule by memory" << std::endl
+    << "    --log-files      Save job output in .build/logs instead of the database"    << std::endl
+    << "    --profile-db     Report time spent in each database statement on exit"       << std::endl
+    << "    --profile-startup=N"                                                         << std::endl
+    << "                     Report time and memory of each phase, and the N slowest"   << std::endl
     << std::endl
     << "  Database introspection:" << std::endl
     << "    --input  -i FILE Report recorded meta-data for jobs which read FILES"        << std::endl
@@ -63,6 +77,11 @@ void print_help(const char *argv0) {
     << "    --verbose  -v    Report recorded standard output and error of matching jobs" << std::endl
     << "    --debug    -d    Report recorded stack frame of matching jobs"               << std::endl
     << "    --script   -s    Format reported jobs as an executable shell script"         << std::endl
+    << "    --impact   FILES Report jobs which rerun if FILES change, with their runtime" << std::endl
+    << "    --json           Format reported jobs as JSON, one object per line"          << std::endl
+    << "    --db-maintain=S  Report and shrink wake.db, vacuuming for up to S seconds"   << std::endl
+    << "    --retain-runs=N  Let --db-maintain drop unkept jobs unused in N runs"        << std::endl
+    << "    --retain-days=D  Let --db-maintain drop unkept jobs unused for D days"       << std::endl
     << std::endl
     << "  Persistent tasks:" << std::endl
     << "    --init=DIR       Create or replace a wake.db in the specified directory"     << std::endl
@@ -72,7 +91,8 @@ void print_help(const char *argv0) {
     << std::endl
     << "  Help functions:" << std::endl
     << "    --version        Print the version of wake on standard output"               << std::endl
-    << "    --html           Print all wake source files as cross-referenced HTML"       << std::endl
+    << "    --html[=DIR]     Print all wake source files as cross-referenced HTML"       << std::endl
+    << "                     or write one page per file into DIR instead"                << std::endl
     << "    --globals  -g    Print all global variables available to the command-line"   << std::endl
     << "    --help     -h    Print this help message and exit"                           << std::endl
     << std::endl;
@@ -96,20 +116,36 @@ int main(int argc, char **argv) {
     { 'd', "debug",                 GOPT_ARGUMENT_FORBIDDEN },
     { 'q', "quiet",                 GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "no-wait",               GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "shared-db",             GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "no-workspace",          GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "no-tty",                GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "lookahead",             GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "pressure",              GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "cgroup",                GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "cgroup-limit",          GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "timeout",               GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "straggler",             GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "sample",                GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "log-files",             GOPT_ARGUMENT_FORBIDDEN },
     { 'i', "input",                 GOPT_ARGUMENT_FORBIDDEN },
     { 'o', "output",                GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "impact",                GOPT_ARGUMENT_FORBIDDEN },
     { 's', "script",                GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "json",                  GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "db-maintain",           GOPT_ARGUMENT_OPTIONAL  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "retain-runs",           GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
+    { 0,   "retain-days",           GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
     { 0,   "init",                  GOPT_ARGUMENT_REQUIRED  },
     { 0,   "list-tasks",            GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "add-task",              GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "remove-task",           GOPT_ARGUMENT_REQUIRED  | GOPT_ARGUMENT_NO_HYPHEN },
     { 0,   "version",               GOPT_ARGUMENT_FORBIDDEN },
     { 'g', "globals",               GOPT_ARGUMENT_FORBIDDEN },
-    { 0,   "html",                  GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "html",                  GOPT_ARGUMENT_OPTIONAL  | GOPT_ARGUMENT_NO_HYPHEN },
     { 'h', "help",                  GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "debug-db",              GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "profile-db",            GOPT_ARGUMENT_FORBIDDEN },
+    { 0,   "profile-startup",       GOPT_ARGUMENT_OPTIONAL  | GOPT_ARGUMENT_NO_HYPHEN },
     { 0,   "stop-after-parse",      GOPT_ARGUMENT_FORBIDDEN },
     { 0,   "stop-after-type-check", GOPT_ARGUMENT_FORBIDDEN },
     { 0,   0,                       GOPT_LAST}};
@@ -122,11 +158,19 @@ int main(int argc, char **argv) {
   bool debug   = arg(options, "debug"   )->count;
   bool quiet   = arg(options, "quiet"   )->count;
   bool wait    =!arg(options, "no-wait" )->count;
+  bool shared  = arg(options, "shared-db")->count;
   bool workspace=!arg(options, "no-workspace")->count;
   bool tty     =!arg(options, "no-tty"  )->count;
+  bool lookahead=arg(options, "lookahead")->count;
+  bool climit  = arg(options, "cgroup-limit")->count;
+  bool logfiles= arg(options, "log-files")->count;
+  bool cgroup  = arg(options, "cgroup"  )->count || climit;
   bool input   = arg(options, "input"   )->count;
   bool output  = arg(options, "output"  )->count;
+  bool impact  = arg(options, "impact"  )->count;
   bool script  = arg(options, "script"  )->count;
+  bool json    = arg(options, "json"    )->count;
+  bool maintain= arg(options, "db-maintain")->count;
   bool list    = arg(options, "list-tasks")->count;
   bool add     = arg(options, "add-task")->count;
   bool version = arg(options, "version" )->count;
@@ -134,12 +178,23 @@ int main(int argc, char **argv) {
   bool global  = arg(options, "globals" )->count;
   bool help    = arg(options, "help"    )->count;
   bool debugdb = arg(options, "debug-db")->count;
+  bool profiledb=arg(options, "profile-db")->count;
+  bool profilestart=arg(options, "profile-startup")->count;
   bool parse   = arg(options, "stop-after-parse")->count;
   bool tcheck  = arg(options, "stop-after-type-check")->count;
 
   const char *jobs   = arg(options, "jobs"  )->argument;
+  const char *pstall = arg(options, "pressure")->argument;
+  const char *tout   = arg(options, "timeout")->argument;
+  const char *slow   = arg(options, "straggler")->argument;
+  const char *every  = arg(options, "sample")->argument;
   const char *init   = arg(options, "init"  )->argument;
+  const char *budget = arg(options, "db-maintain")->argument;
+  const char *rruns  = arg(options, "retain-runs")->argument;
+  const char *rdays  = arg(options, "retain-days")->argument;
   const char *remove = arg(options, "remove-task")->argument;
+  const char *ptop   = arg(options, "profile-startup")->argument;
+  const char *htmldir= arg(options, "html")->argument;
 
   if (help) {
     print_help(argv[0]);
@@ -156,6 +211,16 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (script && json) {
+    std::cerr << "Cannot specify both -s and --json!" << std::endl;
+    return 1;
+  }
+
+  if (script && impact) {
+    std::cerr << "Cannot specify both -s and --impact!" << std::endl;
+    return 1;
+  }
+
   term_init(tty);
 
   int njobs = std::thread::hardware_concurrency();
@@ -168,8 +233,93 @@ int main(int argc, char **argv) {
     }
   }
 
+  double pressure = 0;
+  if (pstall) {
+    char *tail;
+    pressure = strtod(pstall, &tail);
+    if (*tail || pressure <= 0 || pressure > 100) {
+      std::cerr << "Cannot target a pressure of " << pstall << "%!" << std::endl;
+      return 1;
+    }
+  }
+
+  double timeout = 0;
+  if (tout) {
+    char *tail;
+    timeout = strtod(tout, &tail);
+    if (*tail || timeout <= 0) {
+      std::cerr << "Cannot time out jobs after " << tout << " seconds!" << std::endl;
+      return 1;
+    }
+  }
+
+  double straggler = 0;
+  if (slow) {
+    char *tail;
+    straggler = strtod(slow, &tail);
+    if (*tail || straggler <= 1) {
+      std::cerr << "Cannot kill stragglers at " << slow << " times their runtime!" << std::endl;
+      return 1;
+    }
+  }
+
+  double sample = 0;
+  if (every) {
+    char *tail;
+    sample = strtod(every, &tail);
+    if (*tail || sample < 0.01) {
+      std::cerr << "Cannot sample jobs every " << every << " seconds!" << std::endl;
+      return 1;
+    }
+  }
+
+  double vacuum = 10;
+  if (budget) {
+    char *tail;
+    vacuum = strtod(budget, &tail);
+    if (*tail || vacuum < 0) {
+      std::cerr << "Cannot vacuum the database for " << budget << " seconds!" << std::endl;
+      return 1;
+    }
+  }
+
+  int retain_runs = 0;
+  if (rruns) {
+    char *tail;
+    retain_runs = strtol(rruns, &tail, 0);
+    if (*tail || retain_runs < 1) {
+      std::cerr << "Cannot retain jobs used in the last " << rruns << " runs!" << std::endl;
+      return 1;
+    }
+  }
+
+  double retain_days = 0;
+  if (rdays) {
+    char *tail;
+    retain_days = strtod(rdays, &tail);
+    if (*tail || retain_days <= 0) {
+      std::cerr << "Cannot retain jobs used in the last " << rdays << " days!" << std::endl;
+      return 1;
+    }
+  }
+
+  int profile_top = 10;
+  if (ptop) {
+    char *tail;
+    profile_top = strtol(ptop, &tail, 0);
+    if (*tail || profile_top < 0) {
+      std::cerr << "Cannot report the " << ptop << " slowest files and definitions!" << std::endl;
+      return 1;
+    }
+  }
+
+  if ((rruns || rdays) && !maintain) {
+    std::cerr << "Retention policies only apply with --db-maintain!" << std::endl;
+    return 1;
+  }
+
   bool nodb = init;
-  bool noparse = nodb || remove || list || output || input;
+  bool noparse = nodb || remove || list || output || input || impact || maintain;
   bool notype = noparse || parse;
   bool noexecute = notype || add || html || tcheck || global;
 
@@ -191,15 +341,20 @@ int main(int argc, char **argv) {
 
   if (nodb) return 0;
 
-  Database db(debugdb);
-  std::string fail = db.open(wait, !workspace);
+  // Declared before everything it measures, so it reports after they are destroyed
+  StartupProfile profile(profilestart, json, profile_top);
+  profile.phase("open database");
+
+  Database db(debugdb, profiledb);
+  bool readonly = noparse && !remove && !maintain;
+  std::string fail = db.open(wait, !workspace, readonly, shared);
   if (!fail.empty()) {
     std::cerr << "Failed to open wake.db: " << fail << std::endl;
     return 1;
   }
 
   // seed the keyed hash function
-  {
+  if (!readonly) {
     std::random_device rd;
     std::uniform_int_distribution<uint64_t> dist;
     sip_key[0] = dist(rd);
@@ -241,38 +396,56 @@ int main(int argc, char **argv) {
     }
   }
 
+  DescribeFormat format = json ? DESCRIBE_JSON : script ? DESCRIBE_SHELL : DESCRIBE_HUMAN;
+  auto emit = [&](const JobReflection &job) { describe(job, format, debug, verbose); };
+
   if (input) {
     for (int i = 1; i < argc; ++i) {
-      describe(db.explain(make_canonical(prefix + argv[i]), 1, verbose), script, debug, verbose);
+      describe_start(format);
+      db.explain(make_canonical(prefix + argv[i]), 1, verbose, emit);
     }
   }
 
   if (output) {
     for (int i = 1; i < argc; ++i) {
-      describe(db.explain(make_canonical(prefix + argv[i]), 2, verbose), script, debug, verbose);
+      describe_start(format);
+      db.explain(make_canonical(prefix + argv[i]), 2, verbose, emit);
     }
   }
 
+  if (impact) {
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; ++i) files.push_back(make_canonical(prefix + argv[i]));
+    describe_impact(db.impact(files), format);
+  }
+
+  if (maintain) db.maintain(retain_runs, retain_days, vacuum);
+
   if (noparse) return 0;
 
   bool ok = true;
+  profile.phase("find wake files");
   auto wakefiles = find_all_wakefiles(ok, workspace);
   if (!ok) std::cerr << "Workspace wake file enumeration failed" << std::endl;
 
+  profile.phase("find sources");
   Runtime runtime;
   bool sources = find_all_sources(runtime, workspace);
   if (!sources) std::cerr << "Source file enumeration failed" << std::endl;
   ok &= sources;
 
   // Read all wake build files
+  profile.phase("parse");
   Scope::debug = debug;
   std::unique_ptr<Top> top(new Top);
   for (auto &i : wakefiles) {
     if (verbose && debug)
       std::cerr << "Parsing " << i << std::endl;
+    double start = profile.clock();
     Lexer lex(runtime.heap, i.c_str());
     parse_top(*top, lex);
     if (lex.fail) ok = false;
+    profile.parsed(i, start);
   }
 
   std::vector<std::string> globals;
@@ -300,16 +473,19 @@ int main(int argc, char **argv) {
   top->body = std::unique_ptr<Expr>(body);
 
   /* Primitives */
-  JobTable jobtable(&db, njobs, verbose, quiet, check);
+  JobTable jobtable(&db, njobs, verbose, quiet, check, pressure, timeout, straggler, sample, logfiles);
   StringInfo info(verbose, debug, quiet, VERSION_STR);
   PrimMap pmap = prim_register_all(&info, &jobtable);
 
   if (parse) std::cout << top.get();
 
   if (notype) return ok?0:1;
-  std::unique_ptr<Expr> root = bind_refs(std::move(top), pmap);
+
+  profile.phase("type check");
+  std::unique_ptr<Expr> root = bind_refs(std::move(top), pmap, profile.timing());
   if (!root) ok = false;
   ok = ok && sums_ok();
+  profile.phase("output");
 
   if (!ok) {
     if (add) std::cerr << ">>> Expression not added to the active target list <<<" << std::endl;
@@ -318,7 +494,8 @@ int main(int argc, char **argv) {
   }
 
   if (tcheck) std::cout << root.get();
-  if (html) markup_html(std::cout, root.get());
+  if (html && !htmldir) markup_html(std::cout, root.get());
+  if (html && htmldir && !markup_html_dir(htmldir[0] == '/' ? htmldir : prefix + htmldir, root.get())) return 1;
 
   for (auto &g : globals) {
     Expr *e = root.get();
@@ -345,10 +522,20 @@ int main(int argc, char **argv) {
   if (noexecute) return 0;
 
   // Initialize expression hashes for hashing closures
+  profile.phase("hash");
   root->hash();
 
+  profile.phase("runtime init");
+  if (cgroup) {
+    std::string why = cgroup_init(climit);
+    if (!why.empty()) std::cerr << "Not using cgroups: " << why << std::endl;
+  }
+
+  if (lookahead) jobtable.lookahead();
   db.prepare();
   runtime.init(root.get());
+  profile.heap_used = runtime.heap.used();
+  profile.heap_size = runtime.heap.alloc();
 
   // Flush buffered IO before we enter the main loop (which uses unbuffered IO exclusively)
   std::cout << std::flush;
@@ -358,6 +545,7 @@ int main(int argc, char **argv) {
 
   runtime.abort = false;
 
+  profile.phase("evaluate");
   status_init();
   do { runtime.run(); } while (!runtime.abort && jobtable.wait(runtime));
   status_finish();
@@ -398,6 +586,7 @@ int main(int argc, char **argv) {
     }
   }
 
+  profile.phase("clean");
   db.clean();
   return pass?0:1;
 }
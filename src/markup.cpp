@@ -19,39 +19,69 @@
 #include "expr.h"
 #include "execpath.h"
 #include "json5.h"
-#include <set>
+#include <map>
 #include <vector>
+#include <string>
+#include <sstream>
 #include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <assert.h>
 
-struct ParanOrder {
-  bool operator () (Expr *a, Expr *b) const {
-    int cmp = strcmp(a->location.filename, b->location.filename);
-    if (cmp < 0) return true;
-    if (cmp > 0) return false;
-    if (a->location.start < b->location.start) return true;
-    if (a->location.start > b->location.start) return false;
-    return a->location.end > b->location.end;
-  }
+// An AST node or binder to mark up; binders get no Expr of their own
+struct Mark {
+  const char *kind;
+  Location location;
+  Location target;
+  const TypeVar *typeVar;
+  std::string type;
+
+  Mark(const char *kind_, const Location &location_, const Location &target_, const TypeVar *typeVar_)
+   : kind(kind_), location(location_), target(target_), typeVar(typeVar_) { }
 };
 
-struct JSONRender {
-  typedef std::set<Expr*, ParanOrder> ESet;
-  std::vector<std::unique_ptr<Expr> > defs;
-  std::ostream &os;
-  ESet eset;
-  ESet::iterator it;
+// Parents sort before their children
+static bool paran_order(const Mark &a, const Mark &b) {
+  if (a.location.start < b.location.start) return true;
+  if (a.location.start > b.location.start) return false;
+  return a.location.end > b.location.end;
+}
+
+struct Program {
+  const char *filename;
+  std::vector<Mark> marks;
+  Program() : filename(0) { }
+};
 
-  JSONRender(std::ostream &os_) : os(os_) { }
+// Programs ordered by filename, each with its marks in paran_order
+struct Workspace {
+  std::map<std::string, Program> programs;
+  Program *last;
 
+  Workspace(Expr *root);
+  void add(const char *kind, const Location &location, const Location &target, const TypeVar *typeVar);
   void explore(Expr *expr);
-  void dump();
-  void render(Expr *root);
 };
 
-void JSONRender::explore(Expr *expr) {
-  if (expr->location.start.bytes >= 0 && (expr->flags & FLAG_AST) != 0)
-    eset.insert(expr);
+void Workspace::add(const char *kind, const Location &location, const Location &target, const TypeVar *typeVar) {
+  if (!last || last->filename != location.filename) {
+    last = &programs[location.filename];
+    if (!last->filename) last->filename = location.filename;
+  }
+  last->marks.emplace_back(kind, location, target, typeVar);
+}
+
+void Workspace::explore(Expr *expr) {
+  if (expr->location.start.bytes >= 0 && (expr->flags & FLAG_AST) != 0) {
+    Location target = LOCATION;
+    if (expr->type == &VarRef::type) target = static_cast<VarRef*>(expr)->target;
+    add(expr->type->name, expr->location, target, &expr->typeVar);
+  }
 
   if (expr->type == &App::type) {
     App *app = static_cast<App*>(expr);
@@ -59,13 +89,8 @@ void JSONRender::explore(Expr *expr) {
     explore(app->fn.get());
   } else if (expr->type == &Lambda::type) {
     Lambda *lambda = static_cast<Lambda*>(expr);
-    if (lambda->token.start.bytes >= 0) {
-      auto foo = new VarArg(lambda->token);
-      foo->typeVar.setDOB(lambda->typeVar[0]);
-      lambda->typeVar[0].unify(foo->typeVar);
-      defs.emplace_back(foo);
-      eset.insert(foo);
-    }
+    if (lambda->token.start.bytes >= 0)
+      add(VarArg::type.name, lambda->token, LOCATION, &lambda->typeVar[0]);
     explore(lambda->body.get());
   } else if (expr->type == &DefBinding::type) {
     DefBinding *defbinding = static_cast<DefBinding*>(expr);
@@ -76,102 +101,97 @@ void JSONRender::explore(Expr *expr) {
         int val = i.second.index;
         int fun = val - defbinding->val.size();
         Expr *expr = (fun >= 0) ? defbinding->fun[fun].get() : defbinding->val[val].get();
-        auto def = new VarDef(i.second.location);
+        Location target = LOCATION;
         if (i.first.compare(0, 8, "publish ") == 0) {
           assert (expr->type == &App::type);
           App *app = static_cast<App*>(expr);
           assert (app->val->type == &VarRef::type);
-          VarRef *ref = static_cast<VarRef*>(app->val.get());
-          def->target = ref->target;
+          target = static_cast<VarRef*>(app->val.get())->target;
         }
-        def->typeVar.setDOB(expr->typeVar);
-        expr->typeVar.unify(def->typeVar);
-        defs.emplace_back(def);
-        eset.insert(def);
+        add(VarDef::type.name, i.second.location, target, &expr->typeVar);
       }
     }
     explore(defbinding->body.get());
   }
 }
 
-void JSONRender::dump() {
-  Location self = (*it)->location;
-
-  os
-    << "{\"type\":\"" << (*it)->type->name
-    << "\",\"range\":[" << self.start.bytes
-    << "," << (self.end.bytes+1)
-    << "],\"sourceType\":\"";
-  (*it)->typeVar.format(os, (*it)->typeVar);
-  os << "\"";
-
-  Location target = LOCATION;
-
-  if ((*it)->type == &VarRef::type) {
-    VarRef *ref = static_cast<VarRef*>(*it);
-    target = ref->target;
+Workspace::Workspace(Expr *root) : last(0) {
+  explore(root);
+  for (auto &p : programs) {
+    std::vector<Mark> &marks = p.second.marks;
+    // Of several marks on the same range, keep the first explored
+    std::stable_sort(marks.begin(), marks.end(), paran_order);
+    marks.erase(std::unique(marks.begin(), marks.end(), [](const Mark &a, const Mark &b) {
+      return !paran_order(a, b) && !paran_order(b, a);
+    }), marks.end());
+    // TypeVar::format is not reentrant, so types are formatted before any rendering
+    for (auto &m : marks) {
+      std::stringstream s;
+      m.typeVar->format(s, *m.typeVar);
+      m.type = s.str();
+    }
   }
+}
 
-  if ((*it)->type == &VarDef::type) {
-    VarDef *def = static_cast<VarDef*>(*it);
-    target = def->target;
-  }
+static void dump(std::ostream &os, const std::vector<Mark> &marks, size_t &i) {
+  const Mark &self = marks[i];
 
-  if (target.start.bytes >= 0) {
+  os
+    << "{\"type\":\"" << self.kind
+    << "\",\"range\":[" << self.location.start.bytes
+    << "," << (self.location.end.bytes+1)
+    << "],\"sourceType\":\"" << json_escape(self.type) << "\"";
+
+  if (self.target.start.bytes >= 0) {
     os
-      << ",\"target\":{\"filename\":\"" << json_escape(target.filename)
-      << "\",\"range\":[" << target.start.bytes
-      << "," << (target.end.bytes+1)
+      << ",\"target\":{\"filename\":\"" << json_escape(self.target.filename)
+      << "\",\"range\":[" << self.target.start.bytes
+      << "," << (self.target.end.bytes+1)
       << "]}";
   }
 
-  ++it;
+  ++i;
 
   bool body = false;
-  while (it != eset.end()) {
-    Location child = (*it)->location;
-    if (child.filename != self.filename) break;
-    if (child.start > self.end) break;
+  while (i < marks.size() && !(marks[i].location.start > self.location.end)) {
     if (body) os << ","; else os << ",\"body\":[";
     body = true;
-    dump();
+    dump(os, marks, i);
   }
 
   if (body) os << "]";
   os << "}";
 }
 
-void JSONRender::render(Expr *root) {
-  explore(root);
-  it = eset.begin();
-
-  os << "{\"type\":\"Workspace\",\"body\":[";
+static void render(std::ostream &os, const Program &program) {
+  std::ifstream ifs(program.filename);
+  std::string content(
+    (std::istreambuf_iterator<char>(ifs)),
+    (std::istreambuf_iterator<char>()));
+  os
+    << "{\"type\":\"Program\",\"filename\":\"" << json_escape(program.filename)
+    << "\",\"range\":[0," << content.size()
+    << "],\"source\":\"" << json_escape(content)
+    << "\",\"body\":[";
   bool comma = false;
-  while (it != eset.end()) {
-    const char *filename = (*it)->location.filename;
-    std::ifstream ifs(filename);
-    std::string content(
-      (std::istreambuf_iterator<char>(ifs)),
-      (std::istreambuf_iterator<char>()));
+  for (size_t i = 0; i < program.marks.size(); ) {
     if (comma) os << ",";
     comma = true;
-    os
-      << "{\"type\":\"Program\",\"filename\":\"" << json_escape(filename)
-      << "\",\"range\":[0," << content.size()
-      << "],\"source\":\"" << json_escape(content)
-      << "\",\"body\":[";
-    bool comma = false;
-    while (it != eset.end() && (*it)->location.filename == filename) {
-      if (comma) os << ",";
-      comma = true;
-      dump();
-    }
-    os << "]}";
+    dump(os, program.marks, i);
   }
   os << "]}";
 }
+
 void markup_json(std::ostream &os, Expr *root) {
-  JSONRender(os).render(root);
+  Workspace workspace(root);
+  os << "{\"type\":\"Workspace\",\"body\":[";
+  bool comma = false;
+  for (auto &p : workspace.programs) {
+    if (comma) os << ",";
+    comma = true;
+    render(os, p.second);
+  }
+  os << "]}";
 }
 
 void markup_html(std::ostream &os, Expr *root) {
@@ -189,6 +209,134 @@ void markup_html(std::ostream &os, Expr *root) {
   os << main.rdbuf();
   os << "</script>" << std::endl;
   os << "<script type=\"wake\">";
-  JSONRender(os).render(root);
+  markup_json(os, root);
   os << "</script>" << std::endl;
 }
+
+static std::string html_escape(const std::string &str) {
+  std::string out;
+  for (char c : str) {
+    switch (c) {
+      case '&': out += "&amp;";  break;
+      case '<': out += "&lt;";   break;
+      case '>': out += "&gt;";   break;
+      case '"': out += "&quot;"; break;
+      default:  out += c;
+    }
+  }
+  return out;
+}
+
+static bool write_file(const std::string &path, const std::string &content, std::string &error) {
+  std::ofstream out(path);
+  out << content;
+  out.close();
+  if (!out) error = "Failed to write " + path + ": " + strerror(errno);
+  return !!out;
+}
+
+static bool copy_share(const std::string &dir, const char *file, std::string &error) {
+  std::ifstream in(find_execpath() + "/../share/wake/html/" + file);
+  std::stringstream content;
+  content << in.rdbuf();
+  return write_file(dir + "/" + file, content.str(), error);
+}
+
+// Page i shows programs[i]; it only needs xref.js to follow links and uses out of the page
+static bool write_page(const std::string &dir, size_t page, const Program &program, std::string &error) {
+  std::stringstream os;
+  os << "<meta charset=\"UTF-8\">" << std::endl;
+  os << "<title>" << html_escape(program.filename) << "</title>" << std::endl;
+  os << "<link rel=\"stylesheet\" type=\"text/css\" href=\"style.css\">" << std::endl;
+  os << "<script type=\"text/javascript\" src=\"utf8.js\"></script>" << std::endl;
+  os << "<script type=\"text/javascript\" src=\"main.js\"></script>" << std::endl;
+  os << "<script type=\"wake\">{\"type\":\"Workspace\",\"page\":" << page << ",\"body\":[";
+  render(os, program);
+  os << "]}</script>" << std::endl;
+  return write_file(dir + "/" + std::to_string(page) + ".html", os.str(), error);
+}
+
+// The uses of every binder, keyed by "page:start:end" of the binder, as [page, start, end, row]
+static std::string xref(const std::vector<const Program*> &pages) {
+  std::map<std::string, size_t> index;
+  for (size_t i = 0; i < pages.size(); ++i) index[pages[i]->filename] = i;
+
+  std::map<std::string, std::vector<std::string> > uses;
+  for (size_t i = 0; i < pages.size(); ++i) {
+    for (auto &m : pages[i]->marks) {
+      if (m.target.start.bytes < 0) continue;
+      auto t = index.find(m.target.filename);
+      if (t == index.end()) continue;
+      std::stringstream key, use;
+      key << t->second << ":" << m.target.start.bytes << ":" << (m.target.end.bytes+1);
+      use << "[" << i << "," << m.location.start.bytes << "," << (m.location.end.bytes+1) << "," << m.location.start.row << "]";
+      uses[key.str()].push_back(use.str());
+    }
+  }
+
+  std::stringstream os;
+  os << "wakeXref({\"files\":[";
+  for (size_t i = 0; i < pages.size(); ++i)
+    os << (i?",":"") << "\"" << json_escape(pages[i]->filename) << "\"";
+  os << "],\"uses\":{";
+  bool comma = false;
+  for (auto &u : uses) {
+    os << (comma?",":"") << "\"" << u.first << "\":[";
+    comma = true;
+    for (size_t i = 0; i < u.second.size(); ++i)
+      os << (i?",":"") << u.second[i];
+    os << "]";
+  }
+  os << "}});" << std::endl;
+  return os.str();
+}
+
+bool markup_html_dir(const std::string &dir, Expr *root) {
+  if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+    std::cerr << "Failed to create " << dir << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  Workspace workspace(root);
+  std::vector<const Program*> pages;
+  for (auto &p : workspace.programs) pages.push_back(&p.second);
+
+  // Pages are independent, so they are rendered and written in parallel
+  std::vector<std::string> errors(pages.size());
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < pages.size(); )
+      write_page(dir, i, *pages[i], errors[i]);
+  };
+  size_t nthreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), pages.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nthreads; ++i) threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads) t.join();
+
+  std::stringstream index;
+  index << "<meta charset=\"UTF-8\">" << std::endl;
+  index << "<title>Wake sources</title>" << std::endl;
+  index << "<link rel=\"stylesheet\" type=\"text/css\" href=\"style.css\">" << std::endl;
+  index << "<h2>Wake sources</h2>" << std::endl << "<ul>" << std::endl;
+  for (size_t i = 0; i < pages.size(); ++i)
+    index << "<li><a href=\"" << i << ".html\">" << html_escape(pages[i]->filename) << "</a></li>" << std::endl;
+  index << "</ul>" << std::endl;
+
+  errors.emplace_back();
+  write_file(dir + "/index.html", index.str(), errors.back());
+  errors.emplace_back();
+  write_file(dir + "/xref.js", xref(pages), errors.back());
+  for (const char *file : { "style.css", "utf8.js", "main.js" }) {
+    errors.emplace_back();
+    copy_share(dir, file, errors.back());
+  }
+
+  bool ok = true;
+  for (auto &e : errors) {
+    if (e.empty()) continue;
+    std::cerr << e << std::endl;
+    ok = false;
+  }
+  return ok;
+}
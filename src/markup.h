@@ -19,9 +19,12 @@
 #define MARKUP_H
 
 #include <ostream>
+#include <string>
 struct Expr;
 
 void markup_json(std::ostream &os, Expr *root);
 void markup_html(std::ostream &os, Expr *root);
+// One page per wake file, plus index.html and the cross-references between pages in xref.js
+bool markup_html_dir(const std::string &dir, Expr *root);
 
 #endif
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "startup.h"
+#include "json5.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <time.h>
+#include <sys/resource.h>
+
+static double seconds(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static long maxrss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+StartupProfile::StartupProfile(bool enabled_, bool json_, int top_)
+ : enabled(enabled_), json(json_), top(top_), typed(0), heap_used(-1), heap_size(-1), wall0(0), cpu0(0) { }
+
+StartupProfile::~StartupProfile() {
+  if (!enabled) return;
+  phase(0);
+  report();
+}
+
+template <typename T>
+static void keep_slowest(std::vector<T> &items, int top) {
+  std::sort(items.begin(), items.end(), [](const T &a, const T &b) { return a.seconds > b.seconds; });
+  if ((int)items.size() > top) items.erase(items.begin() + top, items.end());
+}
+
+void StartupProfile::phase(const char *name) {
+  if (!enabled) return;
+  if (!phases.empty()) {
+    Phase &last = phases.back();
+    last.wall = seconds(CLOCK_MONOTONIC) - wall0;
+    last.cpu  = seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu0;
+    last.maxrss = maxrss();
+  }
+
+  // Describe the slowest definitions now; the wake file names in their Locations die with main()
+  if (!definitions.empty()) {
+    typed += definitions.size();
+    keep_slowest(definitions, top);
+    for (auto &d : definitions) {
+      std::stringstream s;
+      s << d.name << " = <" << d.location.file() << ">";
+      slow_definitions.push_back(Item{s.str(), d.seconds});
+    }
+    definitions.clear();
+  }
+
+  if (name) phases.push_back(Phase{name, 0, 0, 0});
+  wall0 = seconds(CLOCK_MONOTONIC);
+  cpu0  = seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+double StartupProfile::clock() const {
+  return enabled ? seconds(CLOCK_MONOTONIC) : 0;
+}
+
+void StartupProfile::parsed(const std::string &file, double start) {
+  if (enabled) files.push_back(Item{file, seconds(CLOCK_MONOTONIC) - start});
+}
+
+void StartupProfile::report() const {
+  std::vector<Item> slow_files(files);
+  keep_slowest(slow_files, top);
+
+  std::stringstream s;
+  if (json) {
+    s << "{\"phases\":[";
+    for (size_t i = 0; i < phases.size(); ++i) {
+      const Phase &p = phases[i];
+      s << (i?",":"") << "{\"name\":\"" << json_escape(p.name) << "\",\"wall\":" << p.wall
+        << ",\"cpu\":" << p.cpu << ",\"maxrss\":" << p.maxrss << "}";
+    }
+    s << "],\"files\":" << files.size() << ",\"slowest_files\":[";
+    for (size_t i = 0; i < slow_files.size(); ++i)
+      s << (i?",":"") << "{\"file\":\"" << json_escape(slow_files[i].name) << "\",\"seconds\":" << slow_files[i].seconds << "}";
+    s << "],\"definitions\":" << typed << ",\"slowest_definitions\":[";
+    for (size_t i = 0; i < slow_definitions.size(); ++i)
+      s << (i?",":"") << "{\"definition\":\"" << json_escape(slow_definitions[i].name) << "\",\"seconds\":" << slow_definitions[i].seconds << "}";
+    s << "],\"heap_used\":" << heap_used << ",\"heap_size\":" << heap_size << "}" << std::endl;
+    std::cerr << s.str();
+    return;
+  }
+
+  s.setf(std::ios::fixed);
+  s.precision(3);
+  s << "Startup profile (wall ms, cpu ms, peak RSS KB):" << std::endl;
+  for (auto &p : phases)
+    s << "  " << std::setw(11) << p.wall * 1000
+      << std::setw(11) << p.cpu * 1000
+      << std::setw(11) << p.maxrss
+      << "  " << p.name << std::endl;
+  if (!files.empty())
+    s << "Slowest of " << files.size() << " wake files to parse (ms):" << std::endl;
+  for (auto &f : slow_files)
+    s << "  " << std::setw(11) << f.seconds * 1000 << "  " << f.name << std::endl;
+  if (typed)
+    s << "Slowest of " << typed << " top-level definitions to type-check (ms):" << std::endl;
+  for (auto &d : slow_definitions)
+    s << "  " << std::setw(11) << d.seconds * 1000 << "  " << d.name << std::endl;
+  if (heap_size >= 0)
+    s << "Heap at evaluation start: " << heap_used << " of " << heap_size << " bytes used" << std::endl;
+  std::cerr << s.str();
+}
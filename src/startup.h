@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <string>
+#include <vector>
+#include "bind.h"
+
+// Wall time, CPU time and peak RSS of each phase of a run, reported on exit under --profile-startup
+struct StartupProfile {
+  struct Phase {
+    std::string name;
+    double wall, cpu;
+    long maxrss; // KB, at the end of the phase
+  };
+  struct Item {
+    std::string name;
+    double seconds;
+  };
+
+  bool enabled, json;
+  int top; // how many files and definitions to list
+  std::vector<Phase> phases;
+  std::vector<Item> files;
+  std::vector<TypeTiming> definitions; // filled by bind_refs
+  std::vector<Item> slow_definitions;  // the slowest, described while their Locations are valid
+  size_t typed;
+  long heap_used, heap_size; // when evaluation starts; -1 if it never did
+
+  StartupProfile(bool enabled, bool json, int top);
+  ~StartupProfile();
+
+  // End the current phase (if any) and begin the next
+  void phase(const char *name);
+  // Seconds since an arbitrary point, for timing one wake file
+  double clock() const;
+  void parsed(const std::string &file, double start);
+  std::vector<TypeTiming> *timing() { return enabled ? &definitions : 0; }
+
+private:
+  double wall0, cpu0;
+  void report() const;
+};
+
+#endif
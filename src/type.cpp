@@ -21,26 +21,61 @@
 #include "expr.h"
 #include "status.h"
 #include <cstring>
+#include <cstdlib>
 #include <iostream>
 #include <cassert>
+#include <string>
+#include <unordered_set>
+#include <new>
+
+#define ARENA_CHUNK (256*1024)
 
 static int globalClock = 0;
 static int globalEpoch = 1; // before a tagging pass, globalEpoch > TypeVar.epoch for all TypeVars
 
+// TypeChild arrays are bump-allocated and never returned to malloc.
+// Only the most recent array can be released, which covers unify(TypeVar(FN, 2)) temporaries.
+static char *arena_next = 0, *arena_end = 0;
+
+static TypeChild *alloc_children(int nargs) {
+  size_t bytes = nargs * sizeof(TypeChild);
+  if (bytes > (size_t)(arena_end - arena_next)) {
+    size_t chunk = bytes > ARENA_CHUNK ? bytes : ARENA_CHUNK;
+    arena_next = static_cast<char*>(malloc(chunk));
+    if (!arena_next) throw std::bad_alloc();
+    arena_end = arena_next + chunk;
+  }
+  TypeChild *out = reinterpret_cast<TypeChild*>(arena_next);
+  arena_next += bytes;
+  for (int i = 0; i < nargs; ++i) new (out+i) TypeChild;
+  return out;
+}
+
+static void release_children(TypeChild *cargs, int nargs) {
+  for (int i = nargs-1; i >= 0; --i) cargs[i].~TypeChild();
+  if (reinterpret_cast<char*>(cargs+nargs) == arena_next)
+    arena_next = reinterpret_cast<char*>(cargs);
+}
+
+static const char *intern(const char *name) {
+  static std::unordered_set<std::string> names;
+  return names.emplace(name).first->c_str();
+}
+
 TypeChild::TypeChild() : var(), tag(0) { }
 
 TypeVar::TypeVar() : parent(0), epoch(0), var_dob(0), free_dob(0), nargs(0), cargs(0), name("") { }
 
 TypeVar::TypeVar(const char *name_, int nargs_)
- : parent(0), epoch(0), var_dob(++globalClock), free_dob(var_dob), nargs(nargs_), name(name_) {
-  cargs = nargs > 0 ? new TypeChild[nargs] : 0;
+ : parent(0), epoch(0), var_dob(++globalClock), free_dob(var_dob), nargs(nargs_), name(intern(name_)) {
+  cargs = nargs > 0 ? alloc_children(nargs) : 0;
   for (int i = 0; i < nargs; ++i) {
     cargs[i].var.free_dob = cargs[i].var.var_dob = ++globalClock;
   }
 }
 
 TypeVar::~TypeVar() {
-  if (nargs) delete [] cargs;
+  if (nargs) release_children(cargs, nargs);
 }
 
 const TypeVar *TypeVar::find() const {
@@ -74,33 +109,18 @@ void TypeVar::setTag(int i, const char *tag) {
   if (!a->cargs[i].tag) a->cargs[i].tag = tag;
 }
 
-bool TypeVar::contains(const TypeVar *other) const {
-  const TypeVar *a = find();
-  if (a->epoch < globalEpoch) a->epoch = globalEpoch;
-  if (!(a->epoch & 2)) {
-    a->epoch |= 2;
-    if (a == other) return true;
-    for (int i = 0; i < a->nargs; ++i)
-      if (a->cargs[i].var.contains(other))
-        return true;
-  }
-  return false;
-}
-
-void TypeVar::do_sweep() const {
-  const TypeVar *a = find();
-  if ((a->epoch & 2)) {
-    a->epoch &= ~2;
-    for (int i = 0; i < a->nargs; ++i)
-      a->cargs[i].var.do_sweep();
-  }
-}
-
-void TypeVar::do_cap(int dob) {
+// Occurs check which also lowers free_dob to dob, visiting each shared TypeVar once.
+// Only a failed (infinite) unification observes a partial cap, and that is a type error.
+bool TypeVar::do_occurs(const TypeVar *other, int dob) {
   TypeVar *a = find();
+  if (a->epoch == globalEpoch) return false;
+  a->epoch = globalEpoch;
+  if (a == other) return true;
   if (dob < a->free_dob) a->free_dob = dob;
   for (int i = 0; i < a->nargs; ++i)
-    a->cargs[i].var.do_cap(dob);
+    if (a->cargs[i].var.do_occurs(other, dob))
+      return true;
+  return false;
 }
 
 // Always point RHS at LHS (so RHS can be a temporary)
@@ -113,26 +133,22 @@ bool TypeVar::do_unify(TypeVar &other) {
   if (a == b) {
     return true;
   } else if (b->isFree()) {
-    bool infinite = a->contains(b);
-    a->do_sweep();
-    if (!infinite) {
-      a->do_cap(b->free_dob);
-      b->parent = a;
-    }
+    ++globalEpoch;
+    bool infinite = a->do_occurs(b, b->free_dob);
+    if (!infinite) b->parent = a;
     return !infinite;
   } else if (a->isFree()) {
-    bool infinite = b->contains(a);
-    b->do_sweep();
+    ++globalEpoch;
+    bool infinite = b->do_occurs(a, a->free_dob);
     if (!infinite) {
       std::swap(a->name,     b->name);
       std::swap(a->nargs,    b->nargs);
       std::swap(a->cargs,    b->cargs);
       std::swap(a->free_dob, b->free_dob);
-      a->do_cap(b->free_dob);
       b->parent = a;
     }
     return !infinite;
-  } else if (strcmp(a->name, b->name) || a->nargs != b->nargs) {
+  } else if (a->name != b->name || a->nargs != b->nargs) {
     return false;
   } else {
     bool ok = true;
@@ -147,9 +163,6 @@ bool TypeVar::do_unify(TypeVar &other) {
     if (ok) {
       b->parent = a;
       // we cannot clear cargs, because other TypeVars might point through our children
-    } else {
-      if (a->epoch < globalEpoch) a->epoch = globalEpoch;
-      a->epoch |= 1;
     }
     return ok;
   }
@@ -194,7 +207,7 @@ void TypeVar::do_clone(TypeVar &out, const TypeVar &x, int dob) {
       in->link = &out;
       out.name = in->name;
       out.nargs = in->nargs;
-      out.cargs = out.nargs > 0 ? new TypeChild[out.nargs] : 0;
+      out.cargs = out.nargs > 0 ? alloc_children(out.nargs) : 0;
       for (int i = 0; i < out.nargs; ++i) {
         do_clone(out.cargs[i].var, in->cargs[i].var, dob);
         out.cargs[i].tag = in->cargs[i].tag;
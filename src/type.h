@@ -48,15 +48,13 @@ private:
   // free_dob is the DOB of a free variable, unified to the oldest
   int var_dob, free_dob;
   int nargs;
-  TypeChild *cargs;
-  const char *name;
+  TypeChild *cargs; // arena allocated
+  const char *name; // interned; equal names are the same pointer
 
-  bool contains(const TypeVar *other) const;
-  void do_sweep() const;
+  bool do_occurs(const TypeVar *other, int dob);
   static void do_clone(TypeVar &out, const TypeVar &x, int dob);
   static int do_format(std::ostream &os, int dob, const TypeVar &value, const char *tag, const TypeVar *other, int tags, int p);
   bool do_unify(TypeVar &other);
-  void do_cap(int dob);
 
   bool isFree() const { return name[0] == 0; }
 